@@ -1,8 +1,11 @@
 #include <assert.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "diatom.h"
@@ -11,53 +14,167 @@
 #define TOKEN_MAX 30
 #define LABEL_MAX TOKEN_MAX + 10
 #define LINE_MAX 90
-#define LABELS_MAX 250
+
+/* Labels */
+// Label names are interned into a hash table when they are first
+// defined or referenced. The program refers to labels by their index,
+// so resolving a reference does not have to look up its name again.
+#define LABELS_MIN_CAPACITY 1024
 
 struct label {
-  char name[LABEL_MAX];
+  // Offset of the name in label_names.
+  size_t name;
+  unsigned int hash;
   word address;
+  bool defined;
+  // Module and line of the definition.
+  unsigned int module;
+  unsigned int line_number;
 };
 
-// TODO: Allocate on the heap.
-struct label labels[LABELS_MAX] = {
-  (struct label) {
-    .name = "",
-    .address = 0,
+static struct label *labels = NULL;
+static size_t label_count = 0;
+static size_t label_capacity = 0;
+// Slots hold the index of a label plus 1 or 0 if they are free.
+static unsigned int *label_slots = NULL;
+static size_t label_slot_capacity = 0;
+static char *label_names = NULL;
+static size_t label_names_len = 0;
+static size_t label_names_capacity = 0;
+
+static unsigned int hash_label(const char *name, size_t len) {
+  // FNV-1a
+  unsigned int hash = 2166136261u;
+  for (size_t i = 0; i < len; ++i)
+    hash = (hash ^ (byte)name[i]) * 16777619u;
+
+  return hash;
+}
+
+static char *label_name(const struct label *l) {
+  return &label_names[l->name];
+}
+
+// Returns the slot of the label with the given name or the free slot it
+// would go into.
+static unsigned int *label_slot(const char *name, unsigned int hash) {
+  const size_t mask = label_slot_capacity - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    unsigned int *const slot = &label_slots[i];
+    if (*slot == 0) return slot;
+
+    const struct label *const l = &labels[*slot - 1];
+    if (l->hash == hash && strcmp(label_name(l), name) == 0) return slot;
   }
-};
+}
 
-static size_t label_offset = 0;
-static int append_label(char name[LABEL_MAX], unsigned int address) {
-  if (label_offset >= (LABELS_MAX - 1))
-    return dlt_error("maximum number of labels reached");
+static int grow_labels(void) {
+  label_capacity = label_capacity ? 2 * label_capacity : LABELS_MIN_CAPACITY;
+  struct label *grown = realloc(labels, label_capacity * sizeof(*labels));
+  if (grown == NULL) return dlt_error("failed to grow labels");
+  labels = grown;
 
-  struct label l = {
-    .name = "",
-    .address = address,
-  };
-  strlcpy(l.name, name, LABEL_MAX);
-  labels[label_offset] = l;
+  free(label_slots);
+  label_slot_capacity = 2 * label_capacity;
+  label_slots = calloc(label_slot_capacity, sizeof(*label_slots));
+  if (label_slots == NULL) return dlt_error("failed to grow labels");
+
+  for (size_t i = 0; i < label_count; ++i)
+    *label_slot(label_name(&labels[i]), labels[i].hash) = i + 1;
 
-  ++label_offset;
   return 0;
 }
 
-static const struct label * find_label(char *name) {
-  for (size_t i = 0; i < label_offset; ++i) {
-    const struct label *const label = &labels[i];
-    if (dlt_string_equals(name, (char *)label->name)) {
-      return label;
-    }
+// intern_label returns the index of the label with the given name,
+// adding an undefined one if there is none yet.
+static int intern_label(const char *name, unsigned int *index) {
+  const size_t len = strlen(name);
+  const unsigned int hash = hash_label(name, len);
+
+  if (label_count == label_capacity && grow_labels()) return -1;
+
+  unsigned int *const slot = label_slot(name, hash);
+  if (*slot != 0) {
+    *index = *slot - 1;
+    return 0;
   }
 
-  return NULL;
+  if (label_names_len + len + 1 > label_names_capacity) {
+    size_t capacity = label_names_capacity ? 2 * label_names_capacity :
+      LABELS_MIN_CAPACITY * LABEL_MAX;
+    while (label_names_len + len + 1 > capacity) capacity *= 2;
+    char *names = realloc(label_names, capacity);
+    if (names == NULL) return dlt_error("failed to grow labels");
+    label_names = names;
+    label_names_capacity = capacity;
+  }
+  memcpy(&label_names[label_names_len], name, len + 1);
+
+  labels[label_count] = (struct label) {
+    .name = label_names_len,
+    .hash = hash,
+    .address = 0,
+    .defined = false,
+    .module = 0,
+    .line_number = 0,
+  };
+  label_names_len += len + 1;
+  *slot = label_count + 1;
+  *index = label_count++;
+  return 0;
+}
+
+/* Modules */
+// A program is linked from the modules given on the command line, in
+// their order. The labels of all modules share one namespace.
+static char **module_names = NULL;
+static size_t module_count = 0;
+
+static int add_module(char *name, unsigned int *index) {
+  char **names = realloc(module_names, (module_count + 1) * sizeof(*names));
+  if (names == NULL) return dlt_error("failed to grow modules");
+  module_names = names;
+
+  module_names[module_count] = name;
+  *index = module_count++;
+  return 0;
 }
 
+static int define_label(unsigned int index, word address,
+			unsigned int module, unsigned int line_number) {
+  struct label *const l = &labels[index];
+  if (l->defined)
+    return dlt_errorf("%s: line %d: label '%s' is already defined in %s "
+		      "on line %d", module_names[module], line_number,
+		      label_name(l), module_names[l->module], l->line_number);
+
+  l->address = address;
+  l->defined = true;
+  l->module = module;
+  l->line_number = line_number;
+  return 0;
+}
+
+// Tokens that are read before the rest of the file, e.g. the body of
+// an inlined codeword.
+#define PENDING_MAX 64
+
+struct inline_body;
+static void record_token(struct inline_body *body, char *token);
+
 struct tokenizer {
   FILE *file;
   char token[TOKEN_MAX];
   char line_buffer[LINE_MAX];
+  // Where the next token of the line starts, NULL if a new line has to
+  // be read.
+  char *cursor;
   unsigned int line_number;
+  // The next pending token is the last one.
+  char pending[PENDING_MAX][TOKEN_MAX];
+  size_t pending_count;
+  // Every token that is read is recorded here if it is set.
+  struct inline_body *recording;
 };
 
 static struct tokenizer new_tokenizer(FILE *f) {
@@ -65,7 +182,10 @@ static struct tokenizer new_tokenizer(FILE *f) {
     .file = f,
     .token = "",
     .line_buffer = "",
+    .cursor = NULL,
     .line_number = 0,
+    .pending_count = 0,
+    .recording = NULL,
   };
 }
 
@@ -75,61 +195,47 @@ static struct tokenizer new_tokenizer(FILE *f) {
 static int next_line(struct tokenizer *t) {
   assert(t != NULL);
 
-  int err = 0;
-  char *line = NULL;
-  size_t line_cap = 0;
-  ssize_t line_len = 0;
-
   t->line_number++;
-  line_len = getline(&line, &line_cap, t->file);
-  if (line_len == -1) {
+  if (fgets(t->line_buffer, sizeof(t->line_buffer), t->file) == NULL) {
     if (feof(t->file)) return 0;
 
     return dlt_errorf("line %d: error while reading line",
 		      t->line_number);
   }
 
+  const size_t line_len = strnlen(t->line_buffer, sizeof(t->line_buffer));
+  if (t->line_buffer[line_len - 1] != '\n' && !feof(t->file))
+    return dlt_errorf("line %d: identifier '%s' exceeds max length",
+		      t->line_number, t->line_buffer);
 
-  if ((unsigned long)line_len > sizeof(t->line_buffer)) {
-    err = dlt_errorf("line %d: identifier '%s' exceeds max length",
-		     t->line_number, line);
-    goto cleanup;
-  }
-
-  size_t copy_len = strlcpy(t->line_buffer, line, sizeof(t->line_buffer));
-  if (copy_len < (unsigned long)line_len) {
-    err = dlt_errorf("line %d: failed to copy line to buffer",
-		     t->line_number);
-    goto cleanup;
-  }
-
- cleanup:
-  free(line);
-  if (err) return err;
-
-  return copy_len;
+  return line_len;
 }
 
 // next_token reads the token from the input file. It returns the
 // length of the read token, 0 if EOF has been reached or -1 if an
-// error occured.
+// error occured. A token that has not been consumed yet is returned
+// again.
 static int next_token(struct tokenizer *t) {
   assert(t != NULL);
 
-  if (t->token[0] != '\0') return 0;
+  if (t->token[0] != '\0') return strnlen(t->token, TOKEN_MAX);
 
-  char *token = "";
-  static char *line = NULL;
+  if (t->pending_count > 0) {
+    strlcpy(t->token, t->pending[--t->pending_count], sizeof(t->token));
+    if (t->recording != NULL) record_token(t->recording, t->token);
+    return strnlen(t->token, TOKEN_MAX);
+  }
 
+  char *token = "";
   while (true) {
-    if (line == NULL) {
+    if (t->cursor == NULL) {
       int line_len = next_line(t);
       if (line_len <= 0) return line_len;
 
-      line = t->line_buffer;
+      t->cursor = t->line_buffer;
       continue;
     }
-    token = strsep(&line, " \t\n\0");
+    token = strsep(&t->cursor, " \t\n\0");
 
     size_t token_len = strnlen(token, TOKEN_MAX);
     if (token_len > 0) {
@@ -137,6 +243,7 @@ static int next_token(struct tokenizer *t) {
       if (copy_len < (unsigned long)token_len)
 	return dlt_errorf("line %d: failed to copy token", t->line_number);
 
+      if (t->recording != NULL) record_token(t->recording, t->token);
       return token_len;
     }
   }
@@ -150,48 +257,171 @@ static bool is_token_consumed(struct tokenizer *t) {
   return t->token[0] == '\0';
 }
 
-typedef int (*handler)(struct tokenizer *t, FILE *out);
+/* Program */
+// The assembler expands the macros of a .dasm file into a program in
+// memory. The addresses of its labels are assigned once all of it has
+// been read and the image is written from it in a second walk.
+enum entry_kind {
+  ENTRY_OPCODE,
+  ENTRY_BYTE,
+  // Defines a label at the address of the next entry.
+  ENTRY_LABEL,
+  // A cell holding the address of a label.
+  ENTRY_REFERENCE,
+  // The cell of a dictionary header that links it to the previous
+  // header. It holds the index of the header's own label until the
+  // labels are read, then the index of the previous header's label or
+  // NO_LABEL for the first header.
+  ENTRY_LINK,
+  // Marks the end of a dictionary entry, takes no space.
+  ENTRY_WORD_END,
+  // Operands of the short forms picked by the linker (see Encoding): a
+  // two byte cell holding the address of a label and one and two byte
+  // offsets from the opcode in front of them to a label.
+  ENTRY_REFERENCE16,
+  ENTRY_OFFSET8,
+  ENTRY_OFFSET16,
+};
+
+#define NO_LABEL ((unsigned int)-1)
 
-static int translate_file(FILE *in, FILE *out, handler h) {
-  struct tokenizer t = new_tokenizer(in);
+struct entry {
+  enum entry_kind kind;
+  // The byte or, for labels and references, the index of the label.
+  unsigned int value;
+  unsigned int module;
+  unsigned int line_number;
+};
 
-  int err = 0;
-  while ((err = next_token(&t)) > 0) {
-    err = h(&t, out);
-    if (err) return err;
+struct program {
+  struct entry *entries;
+  size_t count;
+  size_t capacity;
+  // Entries are attributed to the current line of this tokenizer, in
+  // this module.
+  const struct tokenizer *source;
+  unsigned int module;
+};
+
+static struct program new_program(void) {
+  return (struct program) {
+    .entries = NULL,
+    .count = 0,
+    .capacity = 0,
+    .source = NULL,
+    .module = 0,
+  };
+}
+
+static void free_program(struct program *p) {
+  free(p->entries);
+  *p = new_program();
+}
+
+static int append_entry(struct program *p, enum entry_kind kind,
+			unsigned int value) {
+  if (p->count == p->capacity) {
+    const size_t capacity = p->capacity ? 2 * p->capacity : 4096;
+    struct entry *entries = realloc(p->entries, capacity * sizeof(*entries));
+    if (entries == NULL) return dlt_error("failed to grow program");
+    p->entries = entries;
+    p->capacity = capacity;
   }
 
-  return err;
+  p->entries[p->count++] = (struct entry) {
+    .kind = kind,
+    .value = value,
+    .module = p->module,
+    .line_number = p->source != NULL ? p->source->line_number : 0,
+  };
+  return 0;
+}
+
+static struct label *entry_label(const struct entry *e) {
+  return &labels[e->value];
+}
+
+// Appends an entry for a label or reference to '<prefix><name>'.
+static int append_named_entry(struct program *p, enum entry_kind kind,
+			      char *prefix, char *name) {
+  char label[LABEL_MAX] = "";
+  strlcpy(label, prefix, sizeof(label));
+  if (strlcat(label, name, sizeof(label)) >= sizeof(label))
+    return dlt_errorf("line %d: label '%s%s' exceeds max length",
+		      p->source != NULL ? p->source->line_number : 0,
+		      prefix, name);
+
+  unsigned int index = 0;
+  if (intern_label(label, &index)) return -1;
+  return append_entry(p, kind, index);
+}
+
+static int emit_byte(struct program *p, byte b) {
+  return append_entry(p, ENTRY_BYTE, b);
+}
+
+static int emit_opcode(struct program *p, char *name) {
+  const byte opcode = name_to_opcode(name);
+  if (opcode >= INSTRUCTION_COUNT)
+    return dlt_errorf("line %d: '%s' is not a valid instruction",
+		      p->source != NULL ? p->source->line_number : 0, name);
+  // The short forms come last.
+  if (opcode >= CONST8)
+    return dlt_errorf("line %d: '%s' is picked by the linker",
+		      p->source != NULL ? p->source->line_number : 0, name);
+
+  return append_entry(p, ENTRY_OPCODE, opcode);
 }
 
-static int create_output_file(char *input_filename,
-			      char *output_filename,
-			      handler handler,
-			      char *write_mode) {
+// Byte order of the cells in the generated image.
+static enum cell_order cell_order = CELLS_BIG_ENDIAN;
+
+static int emit_word(struct program *p, word w) {
+  byte bytes[WORD_SIZE] = {0};
+  word_to_bytes(w, bytes, cell_order);
+
   int err = 0;
+  for (unsigned int i = 0; i < WORD_SIZE; ++i)
+    if ((err = emit_byte(p, bytes[i]))) return err;
 
-  FILE* in = fopen(input_filename, "r");
-  if (in == NULL) {
-    return dlt_error("failed to open input file");
-  }
+  return 0;
+}
 
-  FILE* out = fopen(output_filename, write_mode);
-  if (out == NULL) {
-    err = dlt_error("failed to open input file");
-    goto close_input_file;
-  }
+static int emit_label(struct program *p, char *prefix, char *name) {
+  return append_named_entry(p, ENTRY_LABEL, prefix, name);
+}
 
-  err = translate_file(in, out, handler);
-  if (err) {
-    goto close_files;
-  }
+static int emit_reference(struct program *p, char *prefix, char *name) {
+  return append_named_entry(p, ENTRY_REFERENCE, prefix, name);
+}
 
- close_files:
-  fclose(out);
- close_input_file:
-  fclose(in);
+// emit_link emits the link to the previous dictionary header of the
+// header with the given name. Headers are linked when the labels are
+// read, so the dictionary can span modules.
+static int emit_link(struct program *p, char *name) {
+  return append_named_entry(p, ENTRY_LINK, "", name);
+}
 
-  return err;
+static int emit_word_end(struct program *p) {
+  return append_entry(p, ENTRY_WORD_END, 0);
+}
+
+static bool looks_like_digit(char *token) {
+  return isdigit(token[0]) || (token[0] == '-' && strnlen(token, TOKEN_MAX) > 1);
+}
+
+static bool is_label(char *token) {
+  return token[0] == '@' && strnlen(token, TOKEN_MAX) > 1;
+}
+
+// emit_token emits a token that is not part of a macro: numbers are
+// cells, ':name' defines a label, '@name' references one and anything
+// else is an instruction.
+static int emit_token(struct program *p, char *token) {
+  if (looks_like_digit(token)) return emit_word(p, (word)atoi(token));
+  if (token[0] == ':') return emit_label(p, "", token + 1);
+  if (is_label(token)) return emit_reference(p, "", token + 1);
+  return emit_opcode(p, token);
 }
 
 static int parse_error(struct tokenizer *t, char *expected) {
@@ -199,7 +429,7 @@ static int parse_error(struct tokenizer *t, char *expected) {
 		    t->line_number, expected, t->token);
 }
 
-static int parse_comment(struct tokenizer *t, FILE *out) {
+static int parse_comment(struct tokenizer *t, struct program *out) {
   (void)out;
 
   if (!dlt_string_equals(t->token, "(")) return 0;
@@ -218,61 +448,30 @@ static int parse_comment(struct tokenizer *t, FILE *out) {
   return err;
 }
 
-static int parse_call(struct tokenizer *t, FILE *out) {
+static int parse_call(struct tokenizer *t, struct program *out) {
   char *token = t->token;
   if (!dlt_string_starts_with(token, "!") || strnlen(token, 2) < 2)
     return 0;
 
   token++;
 
-  if (fprintf(out, "call @_dict%s\n", token) < 0)
-    return dlt_error("failed to write to file");
+  int err = 0;
+  if ((err = emit_opcode(out, "call"))) return err;
+  if ((err = emit_reference(out, "_dict", token))) return err;
 
   consume_token(t);
   return 0;
 }
 
-static int output_as_bytes(word w, FILE *out) {
-  byte bytes[WORD_SIZE] = {0};
-  word_to_bytes(w, bytes);
-
-  for (unsigned int i = 0; i < WORD_SIZE; ++i)
-    if (fprintf(out, "%d\n", bytes[i]) < 0)
-      return dlt_error("failed to write to file");
-
-  return 0;
-}
-
-static bool looks_like_digit(char *token) {
-  return isdigit(token[0]) || (token[0] == '-' && strnlen(token, TOKEN_MAX) > 1);
-}
-
-static bool is_label(char *token) {
-  return token[0] == '@' && strnlen(token, TOKEN_MAX) > 1;
-}
-
 static int insert_dictionary_header(char word_name[TOKEN_MAX],
                                     bool immediate,
-                                    FILE *out) {
+                                    struct program *out) {
   // Insert the start label.
-  if (fprintf(out, ":%s\n", word_name) < 0)
-    return dlt_error("failed to write to file");
+  int err = 0;
+  if ((err = emit_label(out, "", word_name))) return err;
 
   // Insert the address of the previous word.
-  static char last_word_label[LABEL_MAX] = "";
-  if (last_word_label[0] == '\0') {
-    int err = 0;
-    if ((err = output_as_bytes(0, out))) return err;
-  } else {
-    char dict_label[LABEL_MAX] = "@";
-    strlcat(dict_label, last_word_label, sizeof(dict_label));
-
-    if (fputs(dict_label, out) == EOF)
-      return dlt_error("failed to write to file");
-    if (fputs("\n", out) == EOF)
-      return dlt_error("failed to write to file");
-  }
-  memcpy(last_word_label, word_name, sizeof(last_word_label));
+  if ((err = emit_link(out, word_name))) return err;
 
   // Insert the length and name of the word.
   const unsigned int word_len = strnlen(word_name, TOKEN_MAX);
@@ -281,21 +480,238 @@ static int insert_dictionary_header(char word_name[TOKEN_MAX],
   unsigned int header_word_len = word_len;
   if (immediate) header_word_len |= 128;
 
-  if (fprintf(out, "%d\n", header_word_len) < 0)
-    return dlt_error("failed to write to file");
+  if ((err = emit_byte(out, header_word_len))) return err;
+  for (unsigned int i = 0; i < word_len; ++i)
+    if ((err = emit_byte(out, word_name[i]))) return err;
+
+  return emit_label(out, "_dict", word_name);
+}
+
+// parse_superinstruction replaces the instruction sequences listed
+// next to the superinstruction opcodes in diatom.h with their fused
+// counterpart. It returns 1 if it handled the current token, 0 if not
+// or -1 if an error occured. The token following the sequence is left
+// unconsumed. 'returned' is set if the emitted superinstruction
+// already returns from the codeword and '.end' is next.
+static int parse_superinstruction(struct tokenizer *t, struct program *out,
+				  bool *returned) {
+  static const char *const const_fusions[][2] = {
+    { "+", "const+" },
+    { "-", "const-" },
+    { "=", "const=" },
+    { "<", "const<" },
+    { "ret", "constret" },
+    { ".end", "constret" },
+  };
+
+  char *fused = NULL;
+  int err = 0;
+
+  if (dlt_string_equals(t->token, "const")) {
+    consume_token(t);
+    if (next_token(t) <= 0) return parse_error(t, "<const-value>");
+    if (!looks_like_digit(t->token) && !is_label(t->token))
+      return parse_error(t, "<numeric-literal | label>");
+
+    char operand[TOKEN_MAX] = "";
+    strlcpy(operand, t->token, sizeof(operand));
+    consume_token(t);
+
+    if ((err = next_token(t)) < 0) return err;
 
-  for (unsigned int i = 0; i < word_len; ++i) {
-    if (fprintf(out, "%d\n", (word)word_name[i]) < 0)
-      return dlt_error("failed to write to file");
+    if (dlt_string_equals(operand, "-1") && dlt_string_equals(t->token, "cjmp")) {
+      // An unconditional jump takes its target from the cjmp operand.
+      if ((err = emit_opcode(out, "jmp"))) return err;
+      consume_token(t);
+      return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(const_fusions) / sizeof(const_fusions[0]); ++i) {
+      if (dlt_string_equals(t->token, (char *)const_fusions[i][0])) {
+        fused = (char *)const_fusions[i][1];
+        break;
+      }
+    }
+
+    if ((err = emit_opcode(out, fused ? fused : "const"))) return err;
+    if ((err = emit_token(out, operand))) return err;
+  } else if (dlt_string_equals(t->token, "+")) {
+    consume_token(t);
+    if ((err = next_token(t)) < 0) return err;
+
+    if (dlt_string_equals(t->token, "ret") || dlt_string_equals(t->token, ".end"))
+      fused = "+ret";
+    if ((err = emit_opcode(out, fused ? fused : "+"))) return err;
+  } else if (dlt_string_equals(t->token, "rpeek")) {
+    consume_token(t);
+    if ((err = next_token(t)) < 0) return err;
+
+    if (dlt_string_equals(t->token, "+")) fused = "rpeek+";
+    if ((err = emit_opcode(out, fused ? fused : "rpeek"))) return err;
+  } else {
+    return 0;
+  }
+
+  if (fused != NULL && !dlt_string_equals(t->token, ".end")) consume_token(t);
+  *returned = fused != NULL && dlt_string_equals(t->token, ".end");
+  return 1;
+}
+
+// parse_tail_call turns a call that is directly followed by 'ret' or
+// '.end' into a jump, so the callee returns to the caller's caller. It
+// returns 1 if it handled the current token, 0 if not or -1 if an
+// error occured. 'returned' is set if '.end' is next.
+static int parse_tail_call(struct tokenizer *t, struct program *out,
+			   bool *returned) {
+  if (!dlt_string_starts_with(t->token, "!") || strnlen(t->token, 2) < 2)
+    return 0;
+
+  char callee[TOKEN_MAX] = "";
+  strlcpy(callee, t->token + 1, sizeof(callee));
+  consume_token(t);
+
+  int err = 0;
+  if ((err = next_token(t)) < 0) return err;
+
+  const bool tail = err > 0 && (dlt_string_equals(t->token, "ret") ||
+				dlt_string_equals(t->token, ".end"));
+  if ((err = emit_opcode(out, tail ? "jmp" : "call"))) return err;
+  if ((err = emit_reference(out, "_dict", callee))) return err;
+
+  if (tail && dlt_string_equals(t->token, "ret")) consume_token(t);
+  *returned = tail && dlt_string_equals(t->token, ".end");
+  return 1;
+}
+
+// Calls of codewords with '!name' are replaced with the body of the
+// codeword if it spans at most inline_size bytes. The dictionary entry
+// is still created, so the word can be found and called at runtime.
+// Bodies are recorded after the words they call have been inlined into
+// them. Bodies that use the return stack, transfer control or define
+// labels are never inlined.
+#define DEFAULT_INLINE_SIZE 8
+#define INLINE_TOKENS_MAX 8
+
+static unsigned int inline_size = DEFAULT_INLINE_SIZE;
+
+struct inline_body {
+  char name[TOKEN_MAX];
+  char tokens[INLINE_TOKENS_MAX][TOKEN_MAX];
+  size_t count;
+  // Number of bytes the tokens assemble to.
+  unsigned int size;
+  bool inlinable;
+  bool in_comment;
+};
+
+static struct inline_body *inline_bodies = NULL;
+static size_t inline_count = 0;
+static size_t inline_capacity = 0;
+
+static struct inline_body new_inline_body(char *name) {
+  struct inline_body body = { .name = "", .count = 0, .size = 0,
+			      .inlinable = true, .in_comment = false };
+  strlcpy(body.name, name, sizeof(body.name));
+  return body;
+}
+
+static void record_token(struct inline_body *body, char *token) {
+  static const char *const not_inlinable[] = {
+    "ret", "exit", "cjmp", "jmp", "call", "scall", "rpop", "rput",
+    "rpeek", "rpeek+", "constret", "+ret", "save",
+  };
+
+  // Skip comments and the end of the codeword.
+  if (body->in_comment) {
+    body->in_comment = !dlt_string_equals(token, ")");
+    return;
+  }
+  if (dlt_string_equals(token, "(")) {
+    body->in_comment = true;
+    return;
   }
+  if (dlt_string_equals(token, ".end")) return;
 
-  if (fprintf(out, ":_dict%s\n", word_name) < 0)
-    return dlt_error("failed to write to file");
+  if (!body->inlinable) return;
+  if (body->count == INLINE_TOKENS_MAX || token[0] == ':') {
+    body->inlinable = false;
+    return;
+  }
+  for (size_t i = 0; i < sizeof(not_inlinable) / sizeof(not_inlinable[0]); ++i)
+    if (dlt_string_equals(token, (char *)not_inlinable[i])) {
+      body->inlinable = false;
+      return;
+    }
+
+  if (dlt_string_starts_with(token, "!")) {
+    // A call of the codeword itself.
+    if (dlt_string_equals(token + 1, body->name)) body->inlinable = false;
+    body->size += 1 + WORD_SIZE;
+  } else if (looks_like_digit(token) || is_label(token)) {
+    body->size += WORD_SIZE;
+  } else {
+    ++body->size;
+  }
+  strlcpy(body->tokens[body->count++], token, TOKEN_MAX);
+}
 
+// Bodies that cannot be inlined are added as well, so that they hide
+// earlier words of the same name.
+static int add_inline_body(const struct inline_body *body) {
+  if (inline_count == inline_capacity) {
+    inline_capacity = inline_capacity ? 2 * inline_capacity : 64;
+    inline_bodies = realloc(inline_bodies,
+			    inline_capacity * sizeof(*inline_bodies));
+    if (inline_bodies == NULL) return dlt_error("failed to grow inline table");
+  }
+  inline_bodies[inline_count] = *body;
+  if (body->size > inline_size) inline_bodies[inline_count].inlinable = false;
+  ++inline_count;
   return 0;
 }
 
-static int parse_codeword(struct tokenizer *t, FILE *out) {
+// Records the body of a word that only pushes a value or calls a
+// native function: '<opcode> <operand>'.
+static int add_operand_body(char *name, char *opcode, char *operand) {
+  struct inline_body body = new_inline_body(name);
+  record_token(&body, opcode);
+  record_token(&body, operand);
+  return add_inline_body(&body);
+}
+
+static const struct inline_body *find_inline_body(char *name) {
+  // Later definitions replace earlier ones.
+  for (size_t i = inline_count; i > 0; --i)
+    if (dlt_string_equals(inline_bodies[i - 1].name, name))
+      return inline_bodies[i - 1].inlinable ? &inline_bodies[i - 1] : NULL;
+
+  return NULL;
+}
+
+// parse_inline queues the body of the codeword called by the current
+// token in place of the call. It returns 1 if it did, 0 if not.
+static int parse_inline(struct tokenizer *t) {
+  if (!dlt_string_starts_with(t->token, "!") || strnlen(t->token, 2) < 2)
+    return 0;
+
+  const struct inline_body *const body = find_inline_body(t->token + 1);
+  if (body == NULL || t->pending_count + body->count > PENDING_MAX) return 0;
+
+  // The call was recorded when it was read, its body is recorded
+  // instead.
+  struct inline_body *const recording = t->recording;
+  if (recording != NULL && recording->inlinable && recording->count > 0) {
+    --recording->count;
+    recording->size -= 1 + WORD_SIZE;
+  }
+
+  consume_token(t);
+  for (size_t i = body->count; i > 0; --i)
+    strlcpy(t->pending[t->pending_count++], body->tokens[i - 1], TOKEN_MAX);
+  return 1;
+}
+
+static int parse_codeword(struct tokenizer *t, struct program *out) {
   bool immediate = false;
 
   if (dlt_string_equals(t->token, ".codeword"));
@@ -306,38 +722,45 @@ static int parse_codeword(struct tokenizer *t, FILE *out) {
   int err = 0;
   if (next_token(t) <= 0) return parse_error(t, "<codeword-name>");
   if ((err = insert_dictionary_header(t->token, immediate, out))) return err;
+  struct inline_body body = new_inline_body(t->token);
   consume_token(t);
+  t->recording = &body;
 
   // Resolve the remaining entries.
+  bool returned = false;
   while ((err = next_token(t)) > 0) {
     if ((err = parse_comment(t, out))) return err;
+    if (is_token_consumed(t)) continue;
+    if (parse_inline(t)) continue;
+
+    if ((err = parse_tail_call(t, out, &returned)) < 0) return err;
+    if (err > 0) continue;
     if ((err = parse_call(t, out))) return err;
 
     if (is_token_consumed(t)) continue;
 
     char *token = t->token;
     if (dlt_string_equals(token, ".end")) {
-      // Return from the codeword.
-      if (fputs("ret\n", out) == EOF) return dlt_error("failed to write to file");
+      // Return from the codeword unless a superinstruction already did.
+      if (!returned && (err = emit_opcode(out, "ret"))) return err;
+      if ((err = emit_word_end(out))) return err;
 
       consume_token(t);
-      return 0;
+      t->recording = NULL;
+      return add_inline_body(&body);
     }
 
-    if (looks_like_digit(token)) {
-      const int number = atoi(token);
-      if ((err = output_as_bytes((word)number, out))) return err;
-    } else {
-      if (fputs(token, out) == EOF) return dlt_error("failed to write to file");
-      if (fputs("\n", out) == EOF) return dlt_error("failed to write to file");
-    }
+    if ((err = parse_superinstruction(t, out, &returned)) < 0) return err;
+    if (err > 0) continue;
+
+    if ((err = emit_token(out, token))) return err;
     consume_token(t);
   }
 
   return parse_error(t, ".end");
 }
 
-static int parse_var(struct tokenizer *t, FILE *out) {
+static int parse_var(struct tokenizer *t, struct program *out) {
   if (!dlt_string_equals(t->token, ".var"))  return 0;
   consume_token(t);
 
@@ -346,29 +769,24 @@ static int parse_var(struct tokenizer *t, FILE *out) {
   if ((err = insert_dictionary_header(t->token, false, out))) return err;
 
   // Put the variable's address on the data stack and return.
-  if (fprintf(out,
-	      "const\n"
-	      "@_var%s\n"
-	      "ret\n", t->token) < 0)
-    return dlt_error("failed to write to file");
+  if ((err = emit_opcode(out, "constret"))) return err;
+  if ((err = emit_reference(out, "_var", t->token))) return err;
+
+  char address[LABEL_MAX] = "";
+  snprintf(address, sizeof(address), "@_var%s", t->token);
+  if ((err = add_operand_body(t->token, "const", address))) return err;
 
   // Store the variable's value with a separate label.
-  if (fprintf(out, ":_var%s\n", t->token) < 0)
-    return dlt_error("failed to write to file");
+  if ((err = emit_label(out, "_var", t->token))) return err;
   consume_token(t);
 
   if (next_token(t) <= 0) return parse_error(t, "<var-value>");
 
   char *token = t->token;
-  if (looks_like_digit(token)) {
-    const int number = atoi(token);
-    if ((err = output_as_bytes((word)number, out))) return err;
-  } else if (is_label(token)) {
-    if (fputs(token, out) == EOF) return dlt_error("failed to write to file");
-    if (fputs("\n", out) == EOF) return dlt_error("failed to write to file");
-  } else {
+  if (!looks_like_digit(token) && !is_label(token))
     return parse_error(t, "<numeric-literal | label>");
-  }
+  if ((err = emit_token(out, token))) return err;
+  if ((err = emit_word_end(out))) return err;
   consume_token(t);
 
   // Check and consume .end token.
@@ -379,36 +797,30 @@ static int parse_var(struct tokenizer *t, FILE *out) {
   return 0;
 }
 
-static int parse_const(struct tokenizer *t, FILE *out) {
+static int parse_const(struct tokenizer *t, struct program *out) {
   if (!dlt_string_equals(t->token, ".const")) return 0;
   consume_token(t);
 
   int err = 0;
   if (next_token(t) <= 0) return parse_error(t, "<const-name>");
   if ((err = insert_dictionary_header(t->token, false, out))) return err;
+  char name[TOKEN_MAX] = "";
+  strlcpy(name, t->token, sizeof(name));
   consume_token(t);
 
   // Output numeric literal as constant on the stack.
   if (next_token(t) <= 0) return parse_error(t, "<const-value>");
 
-  if (fputs("const", out) == EOF) return dlt_error("failed to write to file");
-  if (fputs("\n", out) == EOF) return dlt_error("failed to write to file");
+  if ((err = emit_opcode(out, "constret"))) return err;
 
   char *token = t->token;
-  if (looks_like_digit(token)) {
-    const int number = atoi(token);
-    if ((err = output_as_bytes((word)number, out))) return err;
-  } else if (is_label(token)) {
-    if (fputs(token, out) == EOF) return dlt_error("failed to write to file");
-    if (fputs("\n", out) == EOF) return dlt_error("failed to write to file");
-  } else {
+  if (!looks_like_digit(token) && !is_label(token))
     return parse_error(t, "<numeric-literal | label>");
-  }
+  if ((err = emit_token(out, token))) return err;
+  if ((err = emit_word_end(out))) return err;
+  if ((err = add_operand_body(name, "const", token))) return err;
   consume_token(t);
 
-  if (fputs("ret", out) == EOF) return dlt_error("failed to write to file");
-  if (fputs("\n", out) == EOF) return dlt_error("failed to write to file");
-
   // Check and consume .end token.
   if (next_token(t) <= 0) return parse_error(t, ".end");
   if (!dlt_string_equals(t->token, ".end")) return parse_error(t, ".end");
@@ -417,118 +829,1077 @@ static int parse_const(struct tokenizer *t, FILE *out) {
   return 0;
 }
 
-static int macro_handler(struct tokenizer *t, FILE *out) {
+// parse_native creates a dictionary entry that calls a native function
+// of the runtime: '.native <name> [index] .end'. The index of a
+// built-in function is looked up by its name, the ones registered by
+// programs embedding the runtime have to be given.
+static int parse_native(struct tokenizer *t, struct program *out) {
+  if (!dlt_string_equals(t->token, ".native")) return 0;
+  consume_token(t);
+
+  int err = 0;
+  if (next_token(t) <= 0) return parse_error(t, "<native-name>");
+  if ((err = insert_dictionary_header(t->token, false, out))) return err;
+  char name[TOKEN_MAX] = "";
+  strlcpy(name, t->token, sizeof(name));
+  int index = name_to_native(t->token);
+  consume_token(t);
+
+  if (next_token(t) <= 0) return parse_error(t, ".end");
+  if (looks_like_digit(t->token)) {
+    index = atoi(t->token);
+    consume_token(t);
+    if (next_token(t) <= 0) return parse_error(t, ".end");
+  }
+  if (index < 0)
+    return dlt_errorf("line %d: unknown native function, expected an index",
+		      t->line_number);
+
+  if ((err = emit_opcode(out, "native"))) return err;
+  if ((err = emit_word(out, (word)index))) return err;
+  if ((err = emit_opcode(out, "ret"))) return err;
+  if ((err = emit_word_end(out))) return err;
+
+  char operand[TOKEN_MAX] = "";
+  snprintf(operand, sizeof(operand), "%d", index);
+  if ((err = add_operand_body(name, "native", operand))) return err;
+
+  // Check and consume .end token.
+  if (!dlt_string_equals(t->token, ".end")) return parse_error(t, ".end");
+  consume_token(t);
+
+  return 0;
+}
+
+static int macro_handler(struct tokenizer *t, struct program *out) {
   int err = 0;
   if ((err = parse_comment(t, out))) return err;
   if ((err = parse_call(t, out))) return err;
   if ((err = parse_codeword(t, out))) return err;
   if ((err = parse_var(t, out))) return err;
   if ((err = parse_const(t, out))) return err;
+  if ((err = parse_native(t, out))) return err;
 
-  // Pipe the token to the output file if nothing matches.
+  // Emit the token as it is if nothing matches.
   if (is_token_consumed(t)) return 0;
 
-  char *token = t->token;
-  if (looks_like_digit(token)) {
-    const int number = atoi(token);
-    if ((err = output_as_bytes((word)number, out))) return err;
-  } else {
-    if (fputs(token, out) == EOF) return dlt_error("failed to write to file");
-    if (fputs("\n", out) == EOF) return dlt_error("failed to write to file");
-  }
+  if ((err = emit_token(out, t->token))) return err;
   consume_token(t);
 
   return 0;
 }
 
-static int read_label_handler(struct tokenizer *t, FILE *out) {
-  // Suppress unused parameter errors.
-  (void)out;
+static int assemble_file(char *filename, struct program *out) {
+  FILE *in = fopen(filename, "r");
+  if (in == NULL) return dlt_error("failed to open input file");
 
-  static unsigned int address = 0;
+  struct tokenizer t = new_tokenizer(in);
+  out->source = &t;
 
   int err = 0;
-  char *token = t->token;
-  if (token[0] == ':') {
-    if ((err = append_label(token + 1, address))) return err;
+  while ((err = next_token(&t)) > 0)
+    if ((err = macro_handler(&t, out))) break;
+
+  out->source = NULL;
+  fclose(in);
+  return err;
+}
+
+static unsigned int entry_size(const struct entry *e) {
+  switch (e->kind) {
+  case ENTRY_LABEL: return 0;
+  case ENTRY_WORD_END: return 0;
+  case ENTRY_REFERENCE: return WORD_SIZE;
+  case ENTRY_LINK: return WORD_SIZE;
+  case ENTRY_REFERENCE16: return 2;
+  case ENTRY_OFFSET16: return 2;
+  default: return 1;
   }
-  else if (is_label(token)) address += WORD_SIZE;
-  else ++address;
+}
 
-  consume_token(t);
+// The value of a reference at address. Offsets are relative to the
+// opcode in front of them.
+static word reference_value(const struct entry *e, const struct label *l,
+			    unsigned int address) {
+  if (e->kind == ENTRY_OFFSET8 || e->kind == ENTRY_OFFSET16)
+    return l->address - (word)(address - 1);
+  return l->address;
+}
+
+// Writes the low size bytes of w in the byte order of cells.
+static void operand_to_bytes(word w, byte *bytes, unsigned int size) {
+  for (unsigned int i = 0; i < size; ++i) {
+    const byte b = (w >> (i * 8)) & 0xFFu;
+    if (cell_order == CELLS_BIG_ENDIAN) bytes[size - (i+1)] = b;
+    else bytes[i] = b;
+  }
+}
+
+// read_labels assigns the addresses of the labels of a program, links
+// its dictionary headers in order and returns its size.
+static int read_labels(struct program *p, unsigned int *size) {
+  unsigned int address = 0;
+  unsigned int previous_header = NO_LABEL;
+
+  int err = 0;
+  for (size_t i = 0; i < p->count; ++i) {
+    struct entry *const e = &p->entries[i];
+    if (e->kind == ENTRY_LABEL &&
+	(err = define_label(e->value, address, e->module, e->line_number)))
+      return err;
+
+    if (e->kind == ENTRY_LINK) {
+      const unsigned int header = e->value;
+      e->value = previous_header;
+      previous_header = header;
+    }
+
+    address += entry_size(e);
+  }
+
+  *size = address;
+  return 0;
+}
+
+static bool is_first_link(const struct entry *e) {
+  return e->kind == ENTRY_LINK && e->value == NO_LABEL;
+}
+
+static const struct label *resolve_reference(const struct entry *e) {
+  const struct label *const l = entry_label(e);
+  if (!l->defined) {
+    dlt_errorf("%s: line %d: Label '%s' does not exist",
+	       module_names[e->module], e->line_number, label_name(l));
+    return NULL;
+  }
+  return l;
+}
+
+// resolve_labels writes the bytes of a program with its references
+// replaced by the addresses of their labels.
+static int resolve_labels(const struct program *p, byte *image) {
+  unsigned int address = 0;
+  for (size_t i = 0; i < p->count; ++i) {
+    const struct entry *const e = &p->entries[i];
+    switch (e->kind) {
+    case ENTRY_LABEL:
+    case ENTRY_WORD_END:
+      break;
+    case ENTRY_REFERENCE:
+    case ENTRY_LINK:
+    case ENTRY_REFERENCE16:
+    case ENTRY_OFFSET8:
+    case ENTRY_OFFSET16: {
+      if (is_first_link(e)) {
+	word_to_bytes(0, &image[address], cell_order);
+	break;
+      }
+      const struct label *const l = resolve_reference(e);
+      if (l == NULL) return -1;
+      operand_to_bytes(reference_value(e, l, address), &image[address],
+		       entry_size(e));
+      break;
+    }
+    default:
+      image[address] = e->value;
+      break;
+    }
+    address += entry_size(e);
+  }
+
+  return 0;
+}
+
+static int write_image(char *output_filename, const byte *image,
+		       unsigned int size) {
+  FILE* out = fopen(output_filename, "wb");
+  if (out == NULL) return dlt_error("failed to open output file");
+
+  struct image_header header = {
+    .magic = "",
+    .version = IMAGE_VERSION,
+    .cell_order = cell_order,
+    .cell_size = WORD_SIZE,
+    .cell_alignment = 1,
+  };
+  memcpy(header.magic, IMAGE_MAGIC, IMAGE_MAGIC_SIZE);
+
+  int err = 0;
+  if (fwrite(&header, sizeof(header), 1, out) == 0)
+    err = dlt_error("failed to write header to .dopc file");
+  else if (size > 0 && fwrite(image, size, 1, out) == 0)
+    err = dlt_error("failed to write binary data to .dopc file");
+
+  if (fclose(out) == EOF && !err)
+    err = dlt_error("failed to write binary data to .dopc file");
   return err;
 }
 
-static int resolve_label_handler(struct tokenizer *t, FILE *out) {
-  static unsigned int address = 0;
+// write_listings writes the program with its macros expanded (.dexp)
+// and with the addresses of its labels (.dins), one entry per line.
+static int write_listings(const struct program *p,
+			  char *dexp_filename,
+			  char *dins_filename) {
+  FILE *dexp = fopen(dexp_filename, "w");
+  if (dexp == NULL) return dlt_error("failed to open output file");
+  FILE *dins = fopen(dins_filename, "w");
+  if (dins == NULL) {
+    fclose(dexp);
+    return dlt_error("failed to open output file");
+  }
 
-  char *token = t->token;
-  if (token[0] == ':') {
-    if (fprintf(out, "( %s @ %d )\n", token, address) < 0)
-      return dlt_error("failed to write to file");
-  } else if (is_label(token)) {
-    char *name = token + 1;
-    const struct label *const l = find_label(name);
-    if (l == NULL)
-      return dlt_errorf("line %d: Label '%s' does not exist", t->line_number, name);
-
-    if (fprintf(out, "( @%s @ %d -> %d )\n",
-		l->name, address, l->address) < 0)
-      return dlt_error("failed to write to file");
-
-    int err = 0;
-    if ((err = output_as_bytes(l->address, out))) return err;
-    address += WORD_SIZE;
-  } else {
-    // Pipe the token to the output file if nothing matches.
-    if (fputs(token, out) == EOF) return dlt_error("failed to write to file");
-    if (fputs("\n", out) == EOF) return dlt_error("failed to write to file");
-    ++address;
+  int err = 0;
+  unsigned int address = 0;
+  for (size_t i = 0; i < p->count && !err; ++i) {
+    const struct entry *const e = &p->entries[i];
+    switch (e->kind) {
+    case ENTRY_OPCODE:
+      if (fprintf(dexp, "%s\n", instruction_names[e->value]) < 0 ||
+	  fprintf(dins, "%s\n", instruction_names[e->value]) < 0)
+	err = dlt_error("failed to write to file");
+      break;
+    case ENTRY_BYTE:
+      if (fprintf(dexp, "%d\n", e->value) < 0 ||
+	  fprintf(dins, "%d\n", e->value) < 0)
+	err = dlt_error("failed to write to file");
+      break;
+    case ENTRY_LABEL:
+      if (fprintf(dexp, ":%s\n", label_name(entry_label(e))) < 0 ||
+	  fprintf(dins, "( :%s @ %d )\n", label_name(entry_label(e)),
+		  address) < 0)
+	err = dlt_error("failed to write to file");
+      break;
+    case ENTRY_WORD_END:
+      break;
+    case ENTRY_REFERENCE:
+    case ENTRY_LINK:
+    case ENTRY_REFERENCE16:
+    case ENTRY_OFFSET8:
+    case ENTRY_OFFSET16: {
+      if (is_first_link(e)) {
+	for (unsigned int j = 0; j < WORD_SIZE && !err; ++j)
+	  if (fprintf(dexp, "0\n") < 0 || fprintf(dins, "0\n") < 0)
+	    err = dlt_error("failed to write to file");
+	break;
+      }
+      const struct label *const l = resolve_reference(e);
+      if (l == NULL) {
+	err = -1;
+	break;
+      }
+      if (fprintf(dexp, "@%s\n", label_name(l)) < 0 ||
+	  fprintf(dins, "( @%s @ %d -> %d )\n", label_name(l), address,
+		  l->address) < 0)
+	err = dlt_error("failed to write to file");
+
+      byte bytes[WORD_SIZE] = {0};
+      operand_to_bytes(reference_value(e, l, address), bytes, entry_size(e));
+      for (unsigned int j = 0; j < entry_size(e) && !err; ++j)
+	if (fprintf(dins, "%d\n", bytes[j]) < 0)
+	  err = dlt_error("failed to write to file");
+      break;
+    }
+    }
+    address += entry_size(e);
   }
 
-  consume_token(t);
+  if (fclose(dins) == EOF && !err) err = dlt_error("failed to write to file");
+  if (fclose(dexp) == EOF && !err) err = dlt_error("failed to write to file");
+  return err;
+}
+
+/* Optimizer */
+// With -O the program is optimized once all of its modules are linked:
+//
+// - Constant arithmetic is folded, e.g. 'const 10 const 6 !pow' into
+//   'const 1000000' once pow is inlined. Constants in front of + - = <
+//   or ret are fused with them, 'const -1 cjmp' becomes a jump and a
+//   branch on any other constant is dropped.
+// - Jumps, branches and calls to a jump go to its target directly and
+//   jumps to 'ret' return directly.
+//
+// With -s the codewords that cannot be reached from the code outside of
+// codewords, from main or from the words kept with -k are left out of
+// the image, dictionary header included. Codewords are only reached
+// through label references, so the ones that are only looked up with
+// 'find' at runtime (e.g. by a REPL) have to be kept explicitly.
+//
+// Sequences are never optimized across a label, so code that is
+// jumped into stays as it is.
+static bool optimize = false;
+static bool shake = false;
+static char **kept_words = NULL;
+static size_t kept_count = 0;
+
+static int keep_word(char *name) {
+  char **words = realloc(kept_words, (kept_count + 1) * sizeof(*words));
+  if (words == NULL) return dlt_error("failed to grow keep list");
+  kept_words = words;
+
+  kept_words[kept_count++] = name;
   return 0;
 }
 
-static int opcode_handler(struct tokenizer *t, FILE *out) {
+static bool has_operand(byte opcode) {
+  switch (opcode) {
+  case CONST: case CJUMP: case CALL: case JUMP: case CONST_ADD:
+  case CONST_SUB: case CONST_EQ: case CONST_LT: case CONST_RET: case NATIVE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Returns the number of entries of the instruction at i, or 0 if there
+// is no instruction with a well-formed operand.
+static size_t instruction_length(const struct entry *entries, size_t count,
+				 size_t i) {
+  if (entries[i].kind != ENTRY_OPCODE) return 0;
+  if (!has_operand(entries[i].value)) return 1;
+
+  if (i + 1 < count && entries[i + 1].kind == ENTRY_REFERENCE) return 2;
+  if (i + WORD_SIZE >= count) return 0;
+  for (size_t j = 1; j <= WORD_SIZE; ++j)
+    if (entries[i + j].kind != ENTRY_BYTE) return 0;
+  return 1 + WORD_SIZE;
+}
+
+static bool is_opcode(const struct entry *e, byte opcode) {
+  return e->kind == ENTRY_OPCODE && e->value == opcode;
+}
+
+// Reads the number operand of the instruction at e. Fails for label
+// references.
+static bool number_operand(const struct entry *e, word *value) {
+  if (e[1].kind != ENTRY_BYTE) return false;
+
+  unsigned int w = 0;
+  for (unsigned int i = 0; i < WORD_SIZE; ++i) {
+    const unsigned int b = e[1 + i].value;
+    if (cell_order == CELLS_BIG_ENDIAN) w = (w << 8) | b;
+    else w |= b << (i * 8);
+  }
+  *value = (word)w;
+  return true;
+}
+
+static bool constant(const struct entry *e, word *value) {
+  return is_opcode(e, CONST) && number_operand(e, value);
+}
+
+// Writes an instruction with a number operand at e and returns its
+// length.
+static size_t write_number_instruction(struct entry *e, byte opcode,
+				       word value) {
+  byte bytes[WORD_SIZE] = {0};
+  word_to_bytes(value, bytes, cell_order);
+
+  const struct entry first = e[0];
+  e[0] = (struct entry) {
+    .kind = ENTRY_OPCODE,
+    .value = opcode,
+    .module = first.module,
+    .line_number = first.line_number,
+  };
+  for (unsigned int i = 0; i < WORD_SIZE; ++i)
+    e[1 + i] = (struct entry) {
+      .kind = ENTRY_BYTE,
+      .value = bytes[i],
+      .module = first.module,
+      .line_number = first.line_number,
+    };
+  return 1 + WORD_SIZE;
+}
+
+// Folds a binary operation on two constants. Operations that would
+// overflow or fail are left to the runtime.
+static bool fold_binary(byte opcode, word a, word b, word *result) {
+  long long r = 0;
+  switch (opcode) {
+  case ADD: case CONST_ADD: r = (long long)a + b; break;
+  case SUBTRACT: case CONST_SUB: r = (long long)a - b; break;
+  case MULTIPLY: r = (long long)a * b; break;
+  case DIVIDE:
+  case MOD:
+    if (b == 0 || (a == INT_MIN && b == -1)) return false;
+    r = opcode == DIVIDE ? a / b : a % b;
+    break;
+  case AND: r = a & b; break;
+  case OR: r = a | b; break;
+  case EQUALS: case CONST_EQ: r = a == b ? -1 : 0; break;
+  case LT: case CONST_LT: r = a < b ? -1 : 0; break;
+  case GT: r = a > b ? -1 : 0; break;
+  default: return false;
+  }
+
+  if (r < INT_MIN || r > INT_MAX) return false;
+  *result = (word)r;
+  return true;
+}
+
+static word fold_pow(word x, word n) {
+  // Wraps like the native function of the runtime.
+  unsigned int base = x;
+  unsigned int result = n < 0 ? base : 1;
+  for (word e = n; e > 0; e >>= 1) {
+    if (e & 1) result *= base;
+    base *= base;
+  }
+  return (word)result;
+}
+
+// The instructions folded last, since the last label.
+#define FOLD_WINDOW 3
+
+struct fold_window {
+  size_t starts[FOLD_WINDOW];
+  size_t count;
+};
+
+static void push_instruction(struct fold_window *w, size_t start) {
+  if (w->count == FOLD_WINDOW) {
+    memmove(&w->starts[0], &w->starts[1],
+	    (FOLD_WINDOW - 1) * sizeof(w->starts[0]));
+    --w->count;
+  }
+  w->starts[w->count++] = start;
+}
+
+// fold_tail tries to combine the last instructions of the window, which
+// end at *end. It returns true if it did.
+static bool fold_tail(struct entry *entries, size_t *end,
+		      struct fold_window *w) {
+  if (w->count < 2) return false;
+
+  struct entry *const last = &entries[w->starts[w->count - 1]];
+  struct entry *const prev = &entries[w->starts[w->count - 2]];
+  const size_t prev_start = w->starts[w->count - 2];
+  word a = 0;
+  word b = 0;
+  word r = 0;
+
+  if (w->count >= 3) {
+    struct entry *const first = &entries[w->starts[w->count - 3]];
+    const size_t first_start = w->starts[w->count - 3];
+    if (constant(first, &a) && constant(prev, &b) &&
+	last->kind == ENTRY_OPCODE) {
+      bool folded = fold_binary(last->value, a, b, &r);
+      if (!folded && is_opcode(last, NATIVE) && number_operand(last, &r) &&
+	  r == NATIVE_POW) {
+	r = fold_pow(a, b);
+	folded = true;
+      }
+      if (folded) {
+	*end = first_start + write_number_instruction(first, CONST, r);
+	w->count -= 2;
+	return true;
+      }
+    }
+  }
+
+  if (!constant(prev, &a)) return false;
+
+  // Instructions that take the constant from the stack.
+  if (last->kind == ENTRY_OPCODE && has_operand(last->value) &&
+      last->value != CONST && number_operand(last, &b) &&
+      fold_binary(last->value, a, b, &r)) {
+    *end = prev_start + write_number_instruction(prev, CONST, r);
+    --w->count;
+    return true;
+  }
+  if (is_opcode(last, NOT)) {
+    *end = prev_start + write_number_instruction(prev, CONST, ~a);
+    --w->count;
+    return true;
+  }
+  if (is_opcode(last, DROP)) {
+    *end = prev_start;
+    w->count -= 2;
+    return true;
+  }
+  if (is_opcode(last, CJUMP)) {
+    if (a != -1) {
+      // The branch is never taken.
+      *end = prev_start;
+      w->count -= 2;
+      return true;
+    }
+    // The target of the jump is the operand of the branch.
+    const size_t operand_len = *end - w->starts[w->count - 1] - 1;
+    prev->value = JUMP;
+    memmove(&prev[1], &last[1], operand_len * sizeof(*prev));
+    *end = prev_start + 1 + operand_len;
+    --w->count;
+    return true;
+  }
+
+  // The superinstructions of the assembler.
+  static const byte fusions[][2] = {
+    { ADD, CONST_ADD },
+    { SUBTRACT, CONST_SUB },
+    { EQUALS, CONST_EQ },
+    { LT, CONST_LT },
+    { RETURN, CONST_RET },
+  };
+  for (size_t i = 0; i < sizeof(fusions) / sizeof(fusions[0]); ++i)
+    if (is_opcode(last, fusions[i][0])) {
+      prev->value = fusions[i][1];
+      *end = prev_start + 1 + WORD_SIZE;
+      --w->count;
+      return true;
+    }
+
+  return false;
+}
+
+static void fold_constants(struct program *p) {
+  struct fold_window window = { .count = 0 };
+
+  size_t end = 0;
+  for (size_t i = 0; i < p->count;) {
+    const size_t len = instruction_length(p->entries, p->count, i);
+    if (len == 0) {
+      // Labels and data end a sequence.
+      p->entries[end++] = p->entries[i++];
+      window.count = 0;
+      continue;
+    }
+
+    const size_t start = end;
+    memmove(&p->entries[end], &p->entries[i], len * sizeof(*p->entries));
+    end += len;
+    i += len;
+
+    push_instruction(&window, start);
+    while (fold_tail(p->entries, &end, &window));
+  }
+
+  p->count = end;
+}
+
+// Returns the first instruction at or after the label defined at i.
+static size_t skip_labels(const struct program *p, size_t i) {
+  while (i < p->count && p->entries[i].kind == ENTRY_LABEL) ++i;
+  return i;
+}
+
+static int thread_jumps(struct program *p) {
+  size_t *const positions = malloc((label_count + 1) * sizeof(*positions));
+  bool *const removed = calloc(p->count + 1, sizeof(*removed));
+  if (positions == NULL || removed == NULL) {
+    free(positions);
+    free(removed);
+    return dlt_error("failed to allocate optimizer");
+  }
+
+  for (size_t i = 0; i < label_count; ++i) positions[i] = p->count;
+  for (size_t i = 0; i < p->count; ++i)
+    if (p->entries[i].kind == ENTRY_LABEL) positions[p->entries[i].value] = i;
+
+  for (size_t i = 0; i + 1 < p->count; ++i) {
+    struct entry *const e = &p->entries[i];
+    if (!(is_opcode(e, JUMP) || is_opcode(e, CJUMP) || is_opcode(e, CALL)) ||
+	e[1].kind != ENTRY_REFERENCE)
+      continue;
+
+    // Follow the chain of jumps, it could be a loop.
+    unsigned int target = e[1].value;
+    size_t at = skip_labels(p, positions[target]);
+    for (unsigned int hops = 0; hops < 16 && at + 1 < p->count &&
+	   is_opcode(&p->entries[at], JUMP) && !removed[at + 1] &&
+	   p->entries[at + 1].kind == ENTRY_REFERENCE; ++hops) {
+      target = p->entries[at + 1].value;
+      at = skip_labels(p, positions[target]);
+    }
+    e[1].value = target;
+
+    if (is_opcode(e, JUMP) && at < p->count &&
+	is_opcode(&p->entries[at], RETURN)) {
+      e->value = RETURN;
+      removed[i + 1] = true;
+    }
+  }
+
+  size_t end = 0;
+  for (size_t i = 0; i < p->count; ++i)
+    if (!removed[i]) p->entries[end++] = p->entries[i];
+  p->count = end;
+
+  free(positions);
+  free(removed);
+  return 0;
+}
+
+// Returns the index of a label or NO_LABEL if there is none.
+static unsigned int find_label(const char *name) {
+  if (label_count == 0) return NO_LABEL;
+
+  const unsigned int slot = *label_slot(name, hash_label(name, strlen(name)));
+  return slot == 0 ? NO_LABEL : slot - 1;
+}
+
+// A codeword starts with the label of its header followed by the link
+// and spans everything up to its ENTRY_WORD_END. Code between the end
+// of a word and the next header is top-level code.
+static bool is_word_start(const struct program *p, size_t i) {
+  return p->entries[i].kind == ENTRY_LABEL && i + 1 < p->count &&
+    p->entries[i + 1].kind == ENTRY_LINK;
+}
+
+static int mark_word(unsigned int label, const unsigned int *owners,
+		     bool *reachable, size_t *pending, size_t *pending_count) {
+  if (label == NO_LABEL || owners[label] == NO_LABEL) return 0;
+
+  const unsigned int word_index = owners[label];
+  if (!reachable[word_index]) {
+    reachable[word_index] = true;
+    pending[(*pending_count)++] = word_index;
+  }
+  return 0;
+}
+
+// Marks the words referenced from the entries in [from, to).
+static void mark_references(const struct program *p, size_t from, size_t to,
+			    const unsigned int *owners, bool *reachable,
+			    size_t *pending, size_t *pending_count) {
+  for (size_t i = from; i < to; ++i)
+    if (p->entries[i].kind == ENTRY_REFERENCE)
+      mark_word(p->entries[i].value, owners, reachable, pending,
+		pending_count);
+}
+
+static int shake_words(struct program *p) {
+  // The entries each word starts and ends at, with the end of the
+  // program as the start of one more word.
+  size_t word_count = 0;
+  for (size_t i = 0; i < p->count; ++i) word_count += is_word_start(p, i);
+
+  size_t *const starts = malloc((word_count + 1) * sizeof(*starts));
+  size_t *const ends = malloc((word_count + 1) * sizeof(*ends));
+  unsigned int *const owners = malloc((label_count + 1) * sizeof(*owners));
+  bool *const reachable = calloc(word_count + 1, sizeof(*reachable));
+  size_t *const pending = malloc((word_count + 1) * sizeof(*pending));
   int err = 0;
-  if ((err = parse_comment(t, out))) return err;
-  if (is_token_consumed(t)) return 0;
+  if (starts == NULL || ends == NULL || owners == NULL || reachable == NULL ||
+      pending == NULL) {
+    err = dlt_error("failed to allocate optimizer");
+    goto cleanup;
+  }
 
-  char *token = t->token;
-  int opcode = EXIT;
-  if (looks_like_digit(token)) {
-    opcode = atoi(token);
-    //    if (opcode > 127 || opcode < -128)
-    //      return dlt_errorf("line %d: '%s' is larger than a single byte",
-    //			t->line_number, token);
-  } else {
-    opcode = name_to_opcode(token);
-    if (opcode < 0)
-      return dlt_errorf("line %d: '%s' is not a valid instruction",
-			t->line_number, token);
+  for (size_t i = 0; i < label_count; ++i) owners[i] = NO_LABEL;
+  size_t word_index = 0;
+  bool in_word = false;
+  for (size_t i = 0; i < p->count; ++i) {
+    const struct entry *const e = &p->entries[i];
+    if (is_word_start(p, i)) {
+      if (in_word) ends[word_index - 1] = i;
+      starts[word_index++] = i;
+      in_word = true;
+    }
+    if (!in_word) continue;
+
+    if (e->kind == ENTRY_LABEL) owners[e->value] = word_index - 1;
+    if (e->kind == ENTRY_WORD_END) {
+      ends[word_index - 1] = i + 1;
+      in_word = false;
+    }
+  }
+  if (in_word) ends[word_index - 1] = p->count;
+  starts[word_count] = p->count;
+
+  // Code outside of codewords, main and the kept words are reachable.
+  size_t pending_count = 0;
+  const size_t outside_end = word_count > 0 ? starts[0] : p->count;
+  mark_references(p, 0, outside_end, owners, reachable, pending,
+		  &pending_count);
+  for (size_t w = 0; w < word_count; ++w)
+    mark_references(p, ends[w], starts[w + 1], owners, reachable, pending,
+		    &pending_count);
+  mark_word(find_label("main"), owners, reachable, pending, &pending_count);
+  for (size_t i = 0; i < kept_count; ++i) {
+    const unsigned int label = find_label(kept_words[i]);
+    if (label == NO_LABEL || owners[label] == NO_LABEL ||
+	!is_word_start(p, starts[owners[label]]) ||
+	p->entries[starts[owners[label]]].value != label) {
+      err = dlt_errorf("cannot keep '%s', there is no such word",
+		       kept_words[i]);
+      goto cleanup;
+    }
+    mark_word(label, owners, reachable, pending, &pending_count);
   }
 
-  const byte b_opcode = (byte)opcode;
-  if (fwrite(&b_opcode, sizeof(b_opcode), 1, out) == 0)
-    return dlt_error("failed to write binary data to .dopc file");
+  while (pending_count > 0) {
+    const size_t w = pending[--pending_count];
+    mark_references(p, starts[w], ends[w], owners, reachable, pending,
+		    &pending_count);
+  }
+
+  // Unreachable words go, the code between words stays.
+  size_t end = outside_end;
+  for (size_t w = 0; w < word_count; ++w) {
+    const size_t from = reachable[w] ? starts[w] : ends[w];
+    const size_t len = starts[w + 1] - from;
+    memmove(&p->entries[end], &p->entries[from], len * sizeof(*p->entries));
+    end += len;
+  }
+  p->count = end;
+
+ cleanup:
+  free(starts);
+  free(ends);
+  free(owners);
+  free(reachable);
+  free(pending);
+  return err;
+}
+
+static int optimize_program(struct program *p) {
+  int err = 0;
+  if (shake && (err = shake_words(p))) return err;
+  if (optimize) {
+    fold_constants(p);
+    if ((err = thread_jumps(p))) return err;
+  }
+
+  return 0;
+}
+
+/* Encoding */
+// Unless -w is given, the linker encodes instructions in the short
+// forms of diatom.h where their operand fits. Numbers are shortened
+// right away, 'const+ 1' is split into 'const8 1 +' which the runtime
+// fuses again. Label operands of const, jmp, cjmp and call start out
+// short once the program is optimized. When the labels have addresses,
+// the ones that do not fit are widened again, which moves the code
+// behind them and can push further operands out of range, so this is
+// repeated until all of them fit. Operands only ever grow, so that
+// ends after at most one round per operand.
+static bool compact = true;
+
+static bool fits(long long value, unsigned int size) {
+  const long long limit = 1LL << (8 * size - 1);
+  return value >= -limit && value < limit;
+}
+
+// The instruction a superinstruction with a number operand fuses to a
+// const, or NOP for const itself.
+static bool split_const(byte opcode, byte *next) {
+  switch (opcode) {
+  case CONST: *next = NOP; return true;
+  case CONST_ADD: *next = ADD; return true;
+  case CONST_SUB: *next = SUBTRACT; return true;
+  case CONST_EQ: *next = EQUALS; return true;
+  case CONST_LT: *next = LT; return true;
+  case CONST_RET: *next = RETURN; return true;
+  default: return false;
+  }
+}
+
+static struct entry derived_entry(const struct entry *from,
+				  enum entry_kind kind, unsigned int value) {
+  return (struct entry) {
+    .kind = kind,
+    .value = value,
+    .module = from->module,
+    .line_number = from->line_number,
+  };
+}
+
+static void shorten_numbers(struct program *p) {
+  size_t end = 0;
+  for (size_t i = 0; i < p->count;) {
+    const struct entry first = p->entries[i];
+    size_t len = instruction_length(p->entries, p->count, i);
+    if (len == 0) len = 1;
+
+    word value = 0;
+    byte next = NOP;
+    unsigned int size = WORD_SIZE;
+    if (len == 1 + WORD_SIZE && split_const(first.value, &next) &&
+	number_operand(&p->entries[i], &value))
+      size = fits(value, 1) ? 1 : fits(value, 2) ? 2 : WORD_SIZE;
+
+    if (size == WORD_SIZE) {
+      memmove(&p->entries[end], &p->entries[i], len * sizeof(*p->entries));
+      end += len;
+      i += len;
+      continue;
+    }
+
+    // The short form is never longer, so it fits in place.
+    byte bytes[WORD_SIZE] = {0};
+    operand_to_bytes(value, bytes, size);
+    p->entries[end++] =
+      derived_entry(&first, ENTRY_OPCODE, size == 1 ? CONST8 : CONST16);
+    for (unsigned int j = 0; j < size; ++j)
+      p->entries[end++] = derived_entry(&first, ENTRY_BYTE, bytes[j]);
+    if (next != NOP) p->entries[end++] = derived_entry(&first, ENTRY_OPCODE, next);
+    i += len;
+  }
+  p->count = end;
+}
+
+// The short form of an instruction with a label operand and the kind
+// of its operand.
+static bool short_form(byte opcode, byte *short_opcode,
+		       enum entry_kind *kind) {
+  switch (opcode) {
+  case CONST: *short_opcode = CONST16; *kind = ENTRY_REFERENCE16; return true;
+  case JUMP: *short_opcode = JUMP8; *kind = ENTRY_OFFSET8; return true;
+  case CJUMP: *short_opcode = CJUMP8; *kind = ENTRY_OFFSET8; return true;
+  case CALL: *short_opcode = CALL16; *kind = ENTRY_OFFSET16; return true;
+  default: return false;
+  }
+}
+
+static byte long_form(byte opcode) {
+  switch (opcode) {
+  case CONST16: return CONST;
+  case JUMP8: return JUMP;
+  case CJUMP8: return CJUMP;
+  case CALL16: return CALL;
+  default: return opcode;
+  }
+}
+
+static void shorten_references(struct program *p) {
+  for (size_t i = 0; i + 1 < p->count; ++i) {
+    struct entry *const e = &p->entries[i];
+    byte opcode = 0;
+    enum entry_kind kind = ENTRY_REFERENCE;
+    if (e->kind == ENTRY_OPCODE && e[1].kind == ENTRY_REFERENCE &&
+	short_form(e->value, &opcode, &kind)) {
+      e->value = opcode;
+      e[1].kind = kind;
+    }
+  }
+}
+
+// Widens the short label operands that do not fit until all of them
+// do and returns the size of the program. The labels must have been
+// read.
+static unsigned int relax_references(struct program *p) {
+  unsigned int address = 0;
+  bool widened = true;
+  while (widened) {
+    widened = false;
+    address = 0;
+    for (size_t i = 0; i < p->count; ++i) {
+      const struct entry *const e = &p->entries[i];
+      if (e->kind == ENTRY_LABEL) labels[e->value].address = address;
+      address += entry_size(e);
+    }
+
+    // Every operand is checked against the same layout.
+    address = 0;
+    for (size_t i = 0; i < p->count; ++i) {
+      struct entry *const e = &p->entries[i];
+      const unsigned int size = entry_size(e);
+      if (e->kind == ENTRY_REFERENCE16 || e->kind == ENTRY_OFFSET8 ||
+	  e->kind == ENTRY_OFFSET16) {
+	const struct label *const l = entry_label(e);
+	// Undefined labels are reported when the image is written.
+	if (l->defined && !fits(reference_value(e, l, address), size)) {
+	  e[-1].value = long_form(e[-1].value);
+	  e->kind = ENTRY_REFERENCE;
+	  widened = true;
+	}
+      }
+      address += size;
+    }
+  }
+
+  return address;
+}
+
+/* Objects */
+// 'dasm -c' assembles a module into a relocatable object (.dobj): its
+// expanded program with the names of the labels it defines and
+// references, but no addresses. Linking appends the objects to one
+// program in the order of the modules, which assigns the addresses and
+// chains the dictionary headers of all modules. Objects are written in
+// the byte order of the host and are only meant to be linked there.
+#define OBJECT_MAGIC "DOBJ"
+#define OBJECT_VERSION 2
+
+struct object_header {
+  char magic[IMAGE_MAGIC_SIZE];
+  byte version;
+  byte cell_order;
+  byte reserved[2];
+  // Codewords inlined in the object.
+  unsigned int inline_size;
+  unsigned int name_count;
+  // Bytes of the NUL-terminated names that follow the header.
+  unsigned int names_len;
+  unsigned int entry_count;
+};
+
+struct object_entry {
+  byte kind;
+  byte reserved[3];
+  // The byte or the index of a label in the names of the object.
+  unsigned int value;
+  unsigned int line_number;
+};
+
+static bool has_label(enum entry_kind kind) {
+  return kind == ENTRY_LABEL || kind == ENTRY_REFERENCE || kind == ENTRY_LINK;
+}
+
+static int write_object(const struct program *p, char *filename) {
+  // Numbers the labels of the module in the order they appear.
+  unsigned int *const names = malloc((label_count + 1) * sizeof(*names));
+  if (names == NULL) return dlt_error("failed to allocate object");
+  for (size_t i = 0; i < label_count; ++i) names[i] = NO_LABEL;
+
+  struct object_header header = {
+    .magic = "",
+    .version = OBJECT_VERSION,
+    .cell_order = cell_order,
+    .reserved = {0},
+    .inline_size = inline_size,
+    .name_count = 0,
+    .names_len = 0,
+    .entry_count = p->count,
+  };
+  memcpy(header.magic, OBJECT_MAGIC, IMAGE_MAGIC_SIZE);
+
+  for (size_t i = 0; i < p->count; ++i) {
+    const struct entry *const e = &p->entries[i];
+    if (!has_label(e->kind) || names[e->value] != NO_LABEL) continue;
+
+    names[e->value] = header.name_count++;
+    header.names_len += strlen(label_name(entry_label(e))) + 1;
+  }
+
+  FILE *out = fopen(filename, "wb");
+  if (out == NULL) {
+    free(names);
+    return dlt_errorf("failed to open output file '%s'", filename);
+  }
+
+  int err = 0;
+  if (fwrite(&header, sizeof(header), 1, out) == 0)
+    err = dlt_error("failed to write to .dobj file");
+
+  // The names are written in the order their labels first appear in.
+  unsigned int written = 0;
+  for (size_t i = 0; i < p->count && !err; ++i) {
+    const struct entry *const e = &p->entries[i];
+    if (!has_label(e->kind) || names[e->value] != written) continue;
+
+    const char *const name = label_name(entry_label(e));
+    if (fwrite(name, strlen(name) + 1, 1, out) == 0)
+      err = dlt_error("failed to write to .dobj file");
+    ++written;
+  }
+
+  for (size_t i = 0; i < p->count && !err; ++i) {
+    const struct entry *const e = &p->entries[i];
+    const struct object_entry o = {
+      .kind = e->kind,
+      .reserved = {0},
+      .value = has_label(e->kind) ? names[e->value] : e->value,
+      .line_number = e->line_number,
+    };
+    if (fwrite(&o, sizeof(o), 1, out) == 0)
+      err = dlt_error("failed to write to .dobj file");
+  }
+
+  if (fclose(out) == EOF && !err) err = dlt_error("failed to write to .dobj file");
+  free(names);
+  if (err) remove(filename);
+  return err;
+}
+
+static int read_object_header(FILE *in, struct object_header *header) {
+  if (fread(header, sizeof(*header), 1, in) == 0 ||
+      memcmp(header->magic, OBJECT_MAGIC, IMAGE_MAGIC_SIZE) != 0)
+    return dlt_error("invalid .dobj file");
+  if (header->version != OBJECT_VERSION)
+    return dlt_errorf("unsupported .dobj version %d", header->version);
 
-  consume_token(t);
   return 0;
 }
 
+// read_object appends the entries of an object to a program.
+static int read_object(char *filename, struct program *out) {
+  FILE *in = fopen(filename, "rb");
+  if (in == NULL) return dlt_errorf("failed to open object file '%s'", filename);
+
+  int err = 0;
+  char *names = NULL;
+  unsigned int *indices = NULL;
+
+  struct object_header header;
+  if ((err = read_object_header(in, &header))) goto cleanup;
+  if (header.cell_order != cell_order) {
+    err = dlt_errorf("'%s' was assembled with another byte order", filename);
+    goto cleanup;
+  }
+
+  names = malloc(header.names_len + 1);
+  indices = malloc((header.name_count + 1) * sizeof(*indices));
+  if (names == NULL || indices == NULL) {
+    err = dlt_error("failed to allocate object");
+    goto cleanup;
+  }
+  if (header.names_len > 0 && fread(names, header.names_len, 1, in) == 0) {
+    err = dlt_errorf("'%s' is truncated", filename);
+    goto cleanup;
+  }
+  names[header.names_len] = '\0';
+
+  size_t offset = 0;
+  for (unsigned int i = 0; i < header.name_count && !err; ++i) {
+    if (offset >= header.names_len) {
+      err = dlt_errorf("'%s' is truncated", filename);
+      break;
+    }
+    err = intern_label(&names[offset], &indices[i]);
+    offset += strlen(&names[offset]) + 1;
+  }
+
+  for (unsigned int i = 0; i < header.entry_count && !err; ++i) {
+    struct object_entry o;
+    if (fread(&o, sizeof(o), 1, in) == 0) {
+      err = dlt_errorf("'%s' is truncated", filename);
+      break;
+    }
+
+    const bool labeled = has_label(o.kind);
+    if (o.kind > ENTRY_WORD_END ||
+	(labeled ? o.value >= header.name_count : o.value > 255)) {
+      err = dlt_errorf("'%s' is corrupt", filename);
+      break;
+    }
+    if ((err = append_entry(out, o.kind, labeled ? indices[o.value] : o.value)))
+      break;
+    // Entries keep the lines of their module's source.
+    out->entries[out->count - 1].line_number = o.line_number;
+  }
+
+ cleanup:
+  free(indices);
+  free(names);
+  fclose(in);
+  return err;
+}
+
 static int replace_extension(char *in,
 			     char *out,
 			     size_t out_len,
+			     char *from,
 			     char *extension) {
   const size_t in_len = strnlen(in, FILENAME_MAX);
   size_t extension_len = strnlen(extension, 100);
   if ((in_len + extension_len) >= out_len)
     return dlt_error("input filename exceeds buffer capacity");
 
-  const char* match_ptr = strstr(in, ".dasm");
+  const char* match_ptr = strstr(in, from);
   if (!match_ptr)
-    return dlt_errorf("invalid input filename: '%s' - must end with '.dasm'", in);
+    return dlt_errorf("invalid filename: '%s' - must end with '%s'", in, from);
 
   const int index = match_ptr - in;
   memcpy(out, in, sizeof(char) * in_len);
@@ -537,49 +1908,272 @@ static int replace_extension(char *in,
   return 0;
 }
 
+static bool is_object_file(char *filename) {
+  const size_t len = strnlen(filename, FILENAME_MAX);
+  return len >= 5 && strcmp(&filename[len - 5], ".dobj") == 0;
+}
+
+/* Separate assembly */
+// Modules whose object is newer than their source and was assembled
+// with the same flags are not assembled again. The others are
+// assembled in up to 'jobs' child processes at the same time, each
+// starting with no labels or inlined codewords of other modules.
+
+// Returns 1 if the object of a module has to be assembled, 0 if not or
+// -1 if an error occured.
+static int needs_assembly(char *source, char *object) {
+  if (is_object_file(source)) return 0;
+
+  struct stat source_stat;
+  struct stat object_stat;
+  if (stat(source, &source_stat) != 0)
+    return dlt_errorf("failed to open input file '%s'", source);
+  if (stat(object, &object_stat) != 0 ||
+      object_stat.st_mtime <= source_stat.st_mtime)
+    return 1;
+
+  FILE *in = fopen(object, "rb");
+  if (in == NULL) return 1;
+
+  struct object_header header;
+  const bool current = read_object_header(in, &header) == 0 &&
+    header.cell_order == cell_order && header.inline_size == inline_size;
+  fclose(in);
+  return !current;
+}
+
+static int assemble_object(char *source, char *object) {
+  struct program program = new_program();
+
+  int err = assemble_file(source, &program);
+  if (!err) err = write_object(&program, object);
+  free_program(&program);
+
+  if (err) {
+    char message[ERR_MSG_MAX] = "";
+    strlcpy(message, error_msg, sizeof(message));
+    dlt_errorf("%s: %s", source, message);
+  }
+  return err;
+}
+
+static int wait_for_module(void) {
+  int status = 0;
+  if (wait(&status) < 0) return dlt_error("failed to wait for the assembler");
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+    return dlt_error("failed to assemble modules");
+
+  return 0;
+}
+
+static int assemble_modules(char **sources, char (*objects)[FILENAME_MAX],
+			    size_t count, unsigned int jobs) {
+  int err = 0;
+  unsigned int running = 0;
+
+  // Children must not flush output buffered before they were started.
+  fflush(NULL);
+
+  for (size_t i = 0; i < count && !err; ++i) {
+    const int needed = needs_assembly(sources[i], objects[i]);
+    if (needed < 0) {
+      err = needed;
+      break;
+    }
+    if (!needed) continue;
+
+    if (running == jobs) {
+      --running;
+      if ((err = wait_for_module())) break;
+    }
+
+    const pid_t pid = fork();
+    if (pid < 0) {
+      err = dlt_error("failed to start the assembler");
+      break;
+    }
+    if (pid == 0) {
+      if (assemble_object(sources[i], objects[i])) dlt_panic();
+      exit(EXIT_SUCCESS);
+    }
+    ++running;
+  }
+
+  // Let the modules that are still being assembled finish.
+  for (; running > 0; --running) {
+    const int module_err = wait_for_module();
+    if (!err) err = module_err;
+  }
+
+  return err;
+}
+
+static int link_objects(char **sources, char (*objects)[FILENAME_MAX],
+			size_t count, struct program *out) {
+  int err = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if ((err = add_module(sources[i], &out->module))) return err;
+    if ((err = read_object(objects[i], out))) return err;
+  }
+
+  return 0;
+}
+
+// link_image assigns the addresses of a program and writes its image.
+static int link_image(struct program *p, char *dopc_filename, bool listings) {
+  int err = 0;
+  if ((err = optimize_program(p))) return err;
+  if (compact) {
+    shorten_numbers(p);
+    shorten_references(p);
+  }
+
+  unsigned int size = 0;
+  if ((err = read_labels(p, &size))) return err;
+  if (compact) size = relax_references(p);
+
+  byte *image = malloc(size > 0 ? size : 1);
+  if (image == NULL) return dlt_error("failed to allocate image");
+
+  if (!(err = resolve_labels(p, image)))
+    err = write_image(dopc_filename, image, size);
+  free(image);
+  if (err || !listings) return err;
+
+  char dexp_filename[FILENAME_MAX] = "";
+  char dins_filename[FILENAME_MAX] = "";
+  if ((err = replace_extension(dopc_filename, dexp_filename, FILENAME_MAX,
+			       ".dopc", ".dexp")))
+    return err;
+  if ((err = replace_extension(dopc_filename, dins_filename, FILENAME_MAX,
+			       ".dopc", ".dins")))
+    return err;
+
+  return write_listings(p, dexp_filename, dins_filename);
+}
+
 static void usage(void) {
-  puts("Usage: dasm [dasm-file]\n");
+  puts("Usage: dasm [flags] [dasm-file]");
+  puts("       dasm [flags] -o <dopc-file> <dasm-file | dobj-file>...\n");
   puts("Flags:");
   puts("  -h - Displays this usage message.");
+  puts("  -b <big|little> - Byte order of cells in the image (default = host).");
+  printf("  -i <bytes> - Inlines codewords up to this size, 0 disables it (default = %d).\n",
+	 DEFAULT_INLINE_SIZE);
+  puts("  -l - Also writes the expanded (.dexp) and resolved (.dins) listings.");
+  puts("  -c - Only assembles the modules into objects (.dobj).");
+  puts("  -o <dopc-file> - Links the modules, in order, into this image.");
+  puts("  -j <jobs> - Assembles up to this many modules at once (default = 1).");
+  puts("  -O - Folds constants and threads jumps.");
+  puts("  -s - Leaves out codewords that main and the code outside of codewords do not use.");
+  puts("  -k <word> - Keeps this codeword with -s, can be given many times.");
+  puts("  -w - Writes every operand as a full cell, without the short forms const8,");
+  puts("       const16, jmp8, cjmp8 and call16.");
 }
 
 int main(int argc, char* argv[]) {
+  cell_order = host_cell_order();
+  bool listings = false;
+  bool compile_only = false;
+  char *output = NULL;
+  unsigned int jobs = 1;
+
   int ch = 0;
-  while ((ch = getopt(argc, argv, "h")) != -1) {
+  while ((ch = getopt(argc, argv, "hb:i:lco:j:Osk:w")) != -1) {
     switch (ch) {
     case 'h':
       usage();
       return EXIT_SUCCESS;
+    case 'b':
+      if (dlt_string_equals(optarg, "big")) cell_order = CELLS_BIG_ENDIAN;
+      else if (dlt_string_equals(optarg, "little")) cell_order = CELLS_LITTLE_ENDIAN;
+      else {
+        usage();
+        dlt_fatal_error("invalid byte order");
+      }
+      break;
+    case 'i':
+      if (!isdigit(optarg[0])) {
+        usage();
+        dlt_fatal_error("invalid inline size");
+      }
+      inline_size = atoi(optarg);
+      break;
+    case 'l':
+      listings = true;
+      break;
+    case 'c':
+      compile_only = true;
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 'j':
+      if (atoi(optarg) <= 0) {
+        usage();
+        dlt_fatal_error("invalid number of jobs");
+      }
+      jobs = atoi(optarg);
+      break;
+    case 'O':
+      optimize = true;
+      break;
+    case 's':
+      shake = true;
+      break;
+    case 'k':
+      if (keep_word(optarg)) dlt_panic();
+      break;
+    case 'w':
+      compact = false;
+      break;
     default:
       usage();
       return EXIT_FAILURE;
     }
   }
 
-  if (argc != 2) {
+  if (argc - optind < 1 ||
+      (!compile_only && output == NULL && argc - optind != 1)) {
     usage();
     dlt_fatal_error("invalid arguments");
   }
 
-  char *dasm_filename = argv[1];
-  char dexp_filename[FILENAME_MAX] = "";
-  char dins_filename[FILENAME_MAX] = "";
-  char dopc_filename[FILENAME_MAX] = "";
-  if (replace_extension(dasm_filename, dexp_filename, FILENAME_MAX, ".dexp"))
-    dlt_panic();
-  if (replace_extension(dasm_filename, dins_filename, FILENAME_MAX, ".dins"))
-    dlt_panic();
-  if (replace_extension(dasm_filename, dopc_filename, FILENAME_MAX, ".dopc"))
-    dlt_panic();
-
-  if (create_output_file(dasm_filename, dexp_filename, macro_handler, "w"))
-    dlt_panic();
-  if (create_output_file(dexp_filename, dins_filename, read_label_handler, "w"))
-    dlt_panic();
-  if (create_output_file(dexp_filename, dins_filename, resolve_label_handler, "w"))
-    dlt_panic();
-  if (create_output_file(dins_filename, dopc_filename, opcode_handler, "wb"))
-    dlt_panic();
+  struct program program = new_program();
+
+  // A single source file is assembled into its image directly.
+  char **sources = &argv[optind];
+  const size_t count = argc - optind;
+  if (!compile_only && output == NULL) {
+    char dopc_filename[FILENAME_MAX] = "";
+    if (replace_extension(sources[0], dopc_filename, FILENAME_MAX,
+			  ".dasm", ".dopc"))
+      dlt_panic();
+    if (add_module(sources[0], &program.module)) dlt_panic();
+    if (assemble_file(sources[0], &program)) dlt_panic();
+    if (link_image(&program, dopc_filename, listings)) dlt_panic();
+
+    free_program(&program);
+    return EXIT_SUCCESS;
+  }
+
+  char (*objects)[FILENAME_MAX] = calloc(count, sizeof(*objects));
+  if (objects == NULL) dlt_fatal_error("failed to allocate modules");
+  for (size_t i = 0; i < count; ++i) {
+    if (is_object_file(sources[i]))
+      strlcpy(objects[i], sources[i], sizeof(objects[i]));
+    else if (replace_extension(sources[i], objects[i], FILENAME_MAX,
+			       ".dasm", ".dobj"))
+      dlt_panic();
+  }
+
+  if (assemble_modules(sources, objects, count, jobs)) dlt_panic();
+  if (!compile_only) {
+    if (link_objects(sources, objects, count, &program)) dlt_panic();
+    if (link_image(&program, output, listings)) dlt_panic();
+  }
 
+  free(objects);
+  free_program(&program);
   return EXIT_SUCCESS;
 }
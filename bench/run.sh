@@ -0,0 +1,150 @@
+#!/bin/sh
+# Runs the benchmarks with the binaries built by 'make bench' and
+# prints a tab separated table: the name of each benchmark, its best
+# wall time in milliseconds out of RUNS runs, the number of executed
+# instructions and instructions per second.
+#
+# The times only cover running the program, not loading the image.
+# Set RUNTIME and BENCH_ASSEMBLER to benchmark other builds of the
+# runtime and the assembler.
+#
+# A second table times the assembler on diatom2.dasm, as a single file
+# and split into MODULES modules for -j, each of them with and without
+# -O. A run assembles it BATCH times, the table has the best average
+# and the size of the image.
+set -e
+
+RUNS=${RUNS:-5}
+BATCH=${BATCH:-10}
+MODULES=${MODULES:-4}
+RUNTIME=${RUNTIME:-bin/runtime-bench}
+COUNTER=bin/runtime-count
+ASSEMBLER=bin/assembler-v2
+BENCH_ASSEMBLER=${BENCH_ASSEMBLER:-bin/assembler-bench}
+OUT=bin/bench
+
+mkdir -p "$OUT"
+
+# A recorded REPL session for diatom2.dasm: arithmetic and stack words,
+# each of them looked up in the dictionary.
+awk 'BEGIN {
+  for (i = 0; i < 20000; ++i)
+    printf "%d %d * %d - . %d dup %d swap over - + . drop\n",
+      i % 997, i % 89, i % 13, i % 4099, i % 31;
+  print "bye";
+}' > "$OUT/interpret.input"
+
+# name, program, stdin and flags of the runtime
+benchmarks="fib bench/fib.dasm /dev/null -d 30 -r 30
+fib-jit bench/fib.dasm /dev/null -j -d 30 -r 30
+loop bench/loop.dasm /dev/null
+calls bench/calls.dasm /dev/null
+calls-jit bench/calls.dasm /dev/null -j
+numbers bench/numbers.dasm /dev/null
+interpret diatom2.dasm $OUT/interpret.input"
+
+# Prints the value of a statistic written by -s.
+statistic() {
+  awk -v name="$1" '$1 == name { print $2 }'
+}
+
+printf 'benchmark\twall_ms\tinstructions\tinstructions_per_sec\n'
+echo "$benchmarks" | while read -r name program input flags; do
+  cp "$program" "$OUT/$name.dasm"
+  "$ASSEMBLER" "$OUT/$name.dasm"
+  image="$OUT/$name.dopc"
+
+  # Compiled words count as a single instruction, so the instructions
+  # of the -j rows are counted without the JIT. Their instructions per
+  # second are those of the same work done interpreted.
+  count_flags=$(echo " $flags " | sed 's/ -j / /')
+  # shellcheck disable=SC2086
+  instructions=$("$COUNTER" -s $count_flags "$image" < "$input" 2>&1 \
+		   >/dev/null | statistic instructions)
+  if [ -z "$instructions" ]; then
+    echo "$name: the runtime failed" >&2
+    exit 1
+  fi
+
+  best=
+  run=0
+  while [ "$run" -lt "$RUNS" ]; do
+    # shellcheck disable=SC2086
+    wall_ns=$("$RUNTIME" -s $flags "$image" < "$input" 2>&1 >/dev/null |
+		statistic wall_ns)
+    if [ -z "$wall_ns" ]; then
+      echo "$name: the runtime failed" >&2
+      exit 1
+    fi
+    if [ -z "$best" ] || [ "$wall_ns" -lt "$best" ]; then best=$wall_ns; fi
+    run=$((run + 1))
+  done
+
+  awk -v name="$name" -v ns="$best" -v count="$instructions" 'BEGIN {
+    printf "%s\t%.3f\t%s\t%.0f\n", name, ns / 1e6, count, count / (ns / 1e9);
+  }'
+done
+
+# Prints the average wall time of running a shell command n times in
+# nanoseconds, or nothing if it failed.
+time_command() {
+  perl -MTime::HiRes=time -e '
+    my ($n, $command) = @ARGV;
+    my $start = time;
+    for (1 .. $n) { system($command) == 0 or exit 1 }
+    printf "%.0f\n", (time - $start) / $n * 1e9;' "$1" "$2" || true
+}
+
+# Splits diatom2.dasm at blank lines that follow the end of a
+# definition.
+ASM="$OUT/asm"
+mkdir -p "$ASM"
+rm -f "$ASM"/*.dasm
+awk -v parts="$MODULES" -v dir="$ASM" 'NR == FNR { ++lines; next }
+  {
+    if (part < parts - 1 && FNR > (part + 1) * lines / parts &&
+        $0 == "" && previous ~ /\.end$/)
+      ++part;
+    print > (dir "/module" part ".dasm");
+    previous = $0;
+  }' diatom2.dasm diatom2.dasm
+cp diatom2.dasm "$ASM/diatom2.dasm"
+modules=$(ls "$ASM"/module*.dasm)
+
+# name and arguments of the assembler, the image is written to
+# $ASM/<name>.dopc
+assemblies="asm $ASM/diatom2.dasm
+asm-O -O $ASM/diatom2.dasm
+asm-j -j $MODULES MODULES
+asm-O-j -O -j $MODULES MODULES"
+
+printf '\nassembly\twall_ms\timage_bytes\n'
+echo "$assemblies" | while read -r name args; do
+  image="$ASM/$name.dopc"
+  case "$args" in
+    *MODULES) args="-o $image ${args%MODULES}$(echo $modules)" ;;
+  esac
+  # Objects that are newer than their modules would not be assembled
+  # again, so they are removed in every row to keep them comparable.
+  command="rm -f $ASM/*.dobj && $BENCH_ASSEMBLER $args"
+
+  best=
+  run=0
+  while [ "$run" -lt "$RUNS" ]; do
+    wall_ns=$(time_command "$BATCH" "$command")
+    if [ -z "$wall_ns" ]; then
+      echo "$name: the assembler failed" >&2
+      exit 1
+    fi
+    if [ -z "$best" ] || [ "$wall_ns" -lt "$best" ]; then best=$wall_ns; fi
+    run=$((run + 1))
+  done
+
+  case "$args" in
+    -o*) ;;
+    *) mv "$ASM/diatom2.dopc" "$image" ;;
+  esac
+  awk -v name="$name" -v ns="$best" -v bytes="$(wc -c < "$image")" 'BEGIN {
+    printf "%s\t%.3f\t%d\n", name, ns / 1e6, bytes;
+  }'
+done
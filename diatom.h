@@ -3,7 +3,7 @@
 
 #include "util.h"
 
-#define INSTRUCTION_COUNT 31
+#define INSTRUCTION_COUNT 53
 #define INSTRUCTION_NAME_MAX 10
 #define WORD_NAME_MAX 10
 
@@ -43,6 +43,54 @@ enum instructions {
   RPEEK,
   BFETCH,
   BSTORE,
+
+  // Superinstructions that fuse the most frequently executed instruction
+  // sequences. The set was picked from dynamic opcode pair counts of the
+  // REPL interpreting arithmetic input: out of ~221M executed
+  // instructions 'const N ret' ran ~12.3M times, '+ ret' ~8.7M,
+  // 'rpeek +' ~5.7M, 'const N +' ~3.2M, 'const N =' ~3.1M, 'const N <'
+  // ~3.0M, 'const N -' ~3.0M and 'const -1 cjmp' ~2.9M times.
+  JUMP,       // const -1 cjmp
+  CONST_ADD,  // const N +
+  CONST_SUB,  // const N -
+  CONST_EQ,   // const N =
+  CONST_LT,   // const N <
+  CONST_RET,  // const N ret
+  ADD_RET,    // + ret
+  RPEEK_ADD,  // rpeek +
+
+  // Writes len bytes of memory starting at addr ( addr len -- ).
+  TYPE,
+  // Returns the newest dictionary header reachable from latest whose
+  // name matches the len bytes at addr, or 0 ( addr len latest -- header ).
+  FIND,
+
+  // Block memory instructions.
+  MOVE,       // ( src dest len -- ), the ranges may overlap
+  FILL,       // ( addr len byte -- )
+  COMPARE,    // ( a b len -- n ), n is -1, 0 or 1 like memcmp
+
+  // Number conversion in bases 2 to 36.
+  PARSE_NUMBER,   // ( addr len base -- n err ), see parse_number()
+  FORMAT_NUMBER,  // ( n base addr -- len )
+
+  // Writes a snapshot of the VM to the file named by the len bytes at
+  // addr ( addr len -- flag ), see save_snapshot() in runtime.c.
+  SAVE,
+
+  // Calls the host function whose index follows the opcode. Its stack
+  // effect is the one it was registered with, see Natives in runtime.c.
+  NATIVE,
+
+  // Short forms the assembler picks where the operand fits. Immediates
+  // are sign-extended and in the byte order of cells, offsets are
+  // relative to the address of the opcode. The runtime decodes them
+  // into the instructions above.
+  CONST8,     // const with a 1 byte immediate
+  CONST16,    // const with a 2 byte immediate
+  JUMP8,      // jmp with a 1 byte offset
+  CJUMP8,     // cjmp with a 1 byte offset
+  CALL16,     // call with a 2 byte offset
 };
 
 char instruction_names[INSTRUCTION_COUNT][INSTRUCTION_NAME_MAX] = {
@@ -77,6 +125,28 @@ char instruction_names[INSTRUCTION_COUNT][INSTRUCTION_NAME_MAX] = {
   "rpeek",
   "b@",
   "b!",
+  "jmp",
+  "const+",
+  "const-",
+  "const=",
+  "const<",
+  "constret",
+  "+ret",
+  "rpeek+",
+  "type",
+  "find",
+  "move",
+  "fill",
+  "compare",
+  "str>num",
+  "num>str",
+  "save",
+  "native",
+  "const8",
+  "const16",
+  "jmp8",
+  "cjmp8",
+  "call16",
 };
 
 byte name_to_opcode(char* name) {
@@ -86,9 +156,66 @@ byte name_to_opcode(char* name) {
     return -1;
 }
 
-void word_to_bytes(word w, byte buf[WORD_SIZE]) {
+/* Natives */
+// Host functions built into the runtime, in the order of their
+// indices. Functions registered by programs that embed the runtime get
+// the indices after them.
+enum natives {
+  NATIVE_POW,     // ( x n -- x^n ), x for n < 0
+  NATIVE_DIVMOD,  // ( a b -- remainder quotient )
+  NATIVE_SCAN,    // ( addr len byte -- index ), -1 if it is not found
+  BUILTIN_NATIVE_COUNT,
+};
+
+char native_names[BUILTIN_NATIVE_COUNT][WORD_NAME_MAX] = {
+  "pow",
+  "/mod",
+  "scan",
+};
+
+int name_to_native(char *name) {
+  for (unsigned int i = 0; i < BUILTIN_NATIVE_COUNT; ++i)
+    if (dlt_string_equals(native_names[i], name)) return i;
+
+  return -1;
+}
+
+/* Images */
+// .dopc images start with a header that records how cells are laid
+// out in the image. Files without the magic number are version 0
+// images, i.e. raw memory with big-endian cells.
+#define IMAGE_MAGIC "DOPC"
+#define IMAGE_MAGIC_SIZE 4
+#define IMAGE_VERSION 1
+// Snapshots written by the runtime start with an image header of
+// this version.
+#define SNAPSHOT_VERSION 2
+
+enum cell_order {
+  CELLS_BIG_ENDIAN,
+  CELLS_LITTLE_ENDIAN,
+};
+
+struct image_header {
+  char magic[IMAGE_MAGIC_SIZE];
+  byte version;
+  byte cell_order;
+  byte cell_size;
+  // Cells follow single byte opcodes, so the assembler does not align
+  // them and always records an alignment of 1.
+  byte cell_alignment;
+};
+
+enum cell_order host_cell_order(void) {
+  const word w = 1;
+  return *(const byte *)&w == 1 ? CELLS_LITTLE_ENDIAN : CELLS_BIG_ENDIAN;
+}
+
+void word_to_bytes(word w, byte buf[WORD_SIZE], enum cell_order order) {
   for (unsigned int i = 0; i < WORD_SIZE; ++i) {
-    buf[WORD_SIZE - (i+1)] = (w >> (i * 8)) & 0xFFu;
+    const byte b = (w >> (i * 8)) & 0xFFu;
+    if (order == CELLS_BIG_ENDIAN) buf[WORD_SIZE - (i+1)] = b;
+    else buf[i] = b;
   }
 }
 
@@ -0,0 +1,118 @@
+// Embeds the DiatomVM through vm.h: runs the REPL of diatom2.dopc in
+// a few instances that share the loaded image, each with its own input
+// and output buffer, and checks what they print. The instances are
+// run in turns for a small budget of steps each.
+//
+// Build runtime.c with -DNO_MAIN and link it with this file, see
+// 'make test'.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../vm.h"
+
+#define OUTPUT_MAX 256
+#define STEPS 1000
+
+struct session {
+  const char *input;
+  const char *expected;
+  size_t cursor;
+  char output[OUTPUT_MAX];
+  size_t len;
+  struct vm *vm;
+  enum vm_status status;
+};
+
+static long read_session(void *context, char *buffer, size_t len) {
+  struct session *const s = context;
+  const size_t left = strlen(s->input) - s->cursor;
+  if (len > left) len = left;
+
+  memcpy(buffer, s->input + s->cursor, len);
+  s->cursor += len;
+  return len;
+}
+
+static int write_session(void *context, const char *buffer, size_t len) {
+  struct session *const s = context;
+  if (len > OUTPUT_MAX - s->len) return -1;
+
+  memcpy(s->output + s->len, buffer, len);
+  s->len += len;
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fputs("Usage: embed <diatom2.dopc>\n", stderr);
+    return EXIT_FAILURE;
+  }
+
+  struct session sessions[] = {
+    { .input = "5 7 + . bye\n", .expected = "12\nVM exited normally\n" },
+    { .input = "2 3 * . 10 4 - . bye\n",
+      .expected = "66\nVM exited normally\n" },
+    { .input = "1 2 swap . . bye\n", .expected = "12\nVM exited normally\n" },
+  };
+  const size_t count = sizeof(sessions) / sizeof(sessions[0]);
+
+  const struct vm_sizes sizes = {
+    .memory_size = 8000,
+    .data_stack_size = 20,
+    .return_stack_size = 20,
+  };
+  struct vm_image *const image = vm_image_load(argv[1], &sizes);
+  if (image == NULL) {
+    fprintf(stderr, "embed: %s\n", vm_error(NULL));
+    return EXIT_FAILURE;
+  }
+
+  int status = EXIT_SUCCESS;
+  for (size_t i = 0; i < count; ++i) {
+    const struct vm_io io = {
+      .read = read_session,
+      .write = write_session,
+      .context = &sessions[i],
+    };
+    sessions[i].status = VM_RUNNING;
+    sessions[i].vm = vm_create(image, &io);
+    if (sessions[i].vm == NULL) {
+      fprintf(stderr, "embed: %s\n", vm_error(NULL));
+      return EXIT_FAILURE;
+    }
+  }
+
+  size_t running = count;
+  while (running > 0) {
+    for (size_t i = 0; i < count; ++i) {
+      struct session *const s = &sessions[i];
+      if (s->status != VM_RUNNING) continue;
+
+      s->status = vm_run(s->vm, STEPS);
+      if (s->status == VM_RUNNING) continue;
+      --running;
+      if (s->status == VM_FAILED) {
+	fprintf(stderr, "embed: session %zu failed: %s\n", i, vm_error(s->vm));
+	status = EXIT_FAILURE;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    struct session *const s = &sessions[i];
+    // Destroying an instance flushes its output.
+    vm_destroy(s->vm);
+    if (s->status == VM_EXITED &&
+	(s->len != strlen(s->expected) ||
+	 memcmp(s->output, s->expected, s->len) != 0)) {
+      fprintf(stderr, "embed: session %zu printed '%.*s' instead of '%s'\n",
+	      i, (int)s->len, s->output, s->expected);
+      status = EXIT_FAILURE;
+    }
+  }
+  vm_image_free(image);
+
+  if (status == EXIT_SUCCESS) puts("embed: ok");
+  return status;
+}
@@ -0,0 +1,103 @@
+// Registers a native function with the DiatomVM through vm.h and runs
+// native.dopc, which calls it from Forth as the word 'gcd', checking
+// what it prints.
+//
+// Build runtime.c with -DNO_MAIN and link it with this file, see
+// 'make test'.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../vm.h"
+
+#define OUTPUT_MAX 64
+
+struct output {
+  char buffer[OUTPUT_MAX];
+  size_t len;
+};
+
+static long read_nothing(void *context, char *buffer, size_t len) {
+  (void)context, (void)buffer, (void)len;
+  return 0;
+}
+
+static int write_output(void *context, const char *buffer, size_t len) {
+  struct output *const out = context;
+  if (len > OUTPUT_MAX - out->len) return -1;
+
+  memcpy(out->buffer + out->len, buffer, len);
+  out->len += len;
+  return 0;
+}
+
+// ( a b -- gcd )
+static int native_gcd(struct vm_native_call *call) {
+  word a = abs(call->cells[0]);
+  word b = abs(call->cells[1]);
+  while (b != 0) {
+    const word r = a % b;
+    a = b;
+    b = r;
+  }
+  call->cells[0] = a;
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fputs("Usage: native <native.dopc>\n", stderr);
+    return EXIT_FAILURE;
+  }
+
+  // native.dasm calls it with '.native gcd 3 .end'.
+  const int index = vm_register_native(native_gcd, 2, 1);
+  if (index != 3) {
+    fprintf(stderr, "native: registered gcd as %d instead of 3\n", index);
+    return EXIT_FAILURE;
+  }
+
+  const struct vm_sizes sizes = {
+    .memory_size = 1000,
+    .data_stack_size = 10,
+    .return_stack_size = 10,
+  };
+  struct vm_image *const image = vm_image_load(argv[1], &sizes);
+  if (image == NULL) {
+    fprintf(stderr, "native: %s\n", vm_error(NULL));
+    return EXIT_FAILURE;
+  }
+
+  struct output out = { .len = 0 };
+  const struct vm_io io = {
+    .read = read_nothing,
+    .write = write_output,
+    .context = &out,
+  };
+  struct vm *const vm = vm_create(image, &io);
+  if (vm == NULL) {
+    fprintf(stderr, "native: %s\n", vm_error(NULL));
+    return EXIT_FAILURE;
+  }
+
+  int status = EXIT_SUCCESS;
+  if (vm_run(vm, VM_UNLIMITED) != VM_EXITED) {
+    fprintf(stderr, "native: %s\n", vm_error(vm));
+    status = EXIT_FAILURE;
+  }
+  // Destroying an instance flushes its output.
+  vm_destroy(vm);
+  vm_image_free(image);
+
+  const char *const expected = "21\n\nVM exited normally\n";
+  if (status == EXIT_SUCCESS &&
+      (out.len != strlen(expected) ||
+       memcmp(out.buffer, expected, out.len) != 0)) {
+    fprintf(stderr, "native: printed '%.*s' instead of '%s'\n",
+	    (int)out.len, out.buffer, expected);
+    status = EXIT_FAILURE;
+  }
+
+  if (status == EXIT_SUCCESS) puts("native: ok");
+  return status;
+}
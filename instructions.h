@@ -0,0 +1,363 @@
+// Handlers of the instructions executed by run().
+//
+// This file is included twice inside of run(): once with stack checks
+// and once without them for the instructions of verified words (see
+// the verifier in runtime.c). INSTRUCTION, HANDLER_VARIANT and the
+// CHECK_ macros are defined accordingly before each inclusion.
+// Instructions that access memory at a computed address call
+// FAULT_POINT() first, in both variants.
+    INSTRUCTION(EXIT): {
+      SPILL();
+      const char message[] = "\nVM exited normally\n";
+      put_bytes(vm, message, sizeof(message) - 1);
+      return VM_EXITED;
+    }
+    INSTRUCTION(NOP): {
+      NEXT(1);
+    }
+    INSTRUCTION(CONST): {
+      PUSH(cache[ip].operand);
+      SKIP();
+    }
+    INSTRUCTION(FETCH): {
+      CHECK_UNDERFLOW(dp, 1);
+      FAULT_POINT();
+      tos = fetch_word(vm, tos);
+      NEXT(1);
+    }
+    INSTRUCTION(STORE): {
+      CHECK_UNDERFLOW(dp, 2);
+      FAULT_POINT();
+      const word address = tos;
+      store_word(vm, address, DS(1));
+      dp -= 2;
+      tos = ds[dp];
+      invalidate(vm, address, WORD_SIZE);
+      NEXT(1);
+    }
+    INSTRUCTION(ADD): {
+      BINARY(+);
+      NEXT(1);
+    }
+    INSTRUCTION(SUBTRACT): {
+      BINARY(-);
+      NEXT(1);
+    }
+    INSTRUCTION(MULTIPLY): {
+      BINARY(*);
+      NEXT(1);
+    }
+    INSTRUCTION(DIVIDE): {
+      BINARY(/);
+      NEXT(1);
+    }
+    INSTRUCTION(MOD): {
+      BINARY(%);
+      NEXT(1);
+    }
+    INSTRUCTION(DUP): {
+      PUSH(tos);
+      NEXT(1);
+    }
+    INSTRUCTION(DROP): {
+      DROP();
+      NEXT(1);
+    }
+    INSTRUCTION(SWAP): {
+      CHECK_UNDERFLOW(dp, 2);
+      const word x = tos;
+      tos = DS(1);
+      DS(1) = x;
+      NEXT(1);
+    }
+    INSTRUCTION(OVER): {
+      CHECK_UNDERFLOW(dp, 2);
+      PUSH(DS(1));
+      NEXT(1);
+    }
+    INSTRUCTION(CJUMP): {
+      CHECK_UNDERFLOW(dp, 1);
+      const word condition = tos;
+      tos = ds[--dp];
+      if ((int)condition == -1) BRANCH(cache[ip].operand);
+      SKIP();
+    }
+    INSTRUCTION(CALL): {
+      const word target = cache[ip].operand;
+      RPUSH(ip + cache[ip].size);
+      CHECK_ENTRY(target);
+      BRANCH(target);
+    }
+    INSTRUCTION(SCALL): {
+      CHECK_UNDERFLOW(dp, 1);
+      const word target = tos;
+      tos = ds[--dp];
+      RPUSH(ip + 1);
+      CHECK_ENTRY(target);
+      JUMP(target);
+    }
+#ifdef JIT
+    INSTRUCTION(JIT_CALL): {
+      const word target = cache[ip].operand;
+      const word size = cache[ip].size;
+      RUN_COMPILED(target, size);
+      // Words that cannot be compiled are called directly from now on.
+      if ((unsigned int)target < (unsigned int)memory_size &&
+	  vm->jit_words[target].state == JIT_FAILED)
+	cache[ip].handler = HANDLER_VARIANT(CALL);
+      RPUSH(ip + size);
+      CHECK_ENTRY(target);
+      BRANCH(target);
+    }
+    INSTRUCTION(JIT_SCALL): {
+      CHECK_UNDERFLOW(dp, 1);
+      const word target = tos;
+      tos = ds[--dp];
+      RUN_COMPILED(target, 1);
+      RPUSH(ip + 1);
+      CHECK_ENTRY(target);
+      JUMP(target);
+    }
+#endif
+    INSTRUCTION(RETURN): {
+      CHECK_UNDERFLOW(rp, 1);
+      const word target = rtos;
+      rtos = rs[--rp];
+      JUMP(target);
+    }
+    INSTRUCTION(KEY): {
+      char c = next_char(vm);
+      PUSH(c);
+      NEXT(1);
+    }
+    INSTRUCTION(EMIT): {
+      CHECK_UNDERFLOW(dp, 1);
+#ifdef DEBUG
+      printf("\n-->'%c'\n\n", (char)tos);
+#else
+      put_char(vm, tos);
+#endif
+      tos = ds[--dp];
+      NEXT(1);
+    }
+    INSTRUCTION(EQUALS): {
+      COMPARE(==);
+      NEXT(1);
+    }
+    INSTRUCTION(NOT): {
+      CHECK_UNDERFLOW(dp, 1);
+      tos = ~tos;
+      NEXT(1);
+    }
+    INSTRUCTION(AND): {
+      BINARY(&);
+      NEXT(1);
+    }
+    INSTRUCTION(OR): {
+      BINARY(|);
+      NEXT(1);
+    }
+    INSTRUCTION(LT): {
+      COMPARE(<);
+      NEXT(1);
+    }
+    INSTRUCTION(GT): {
+      COMPARE(>);
+      NEXT(1);
+    }
+    INSTRUCTION(RPOP): {
+      CHECK_UNDERFLOW(rp, 1);
+      PUSH(rtos);
+      rtos = rs[--rp];
+      NEXT(1);
+    }
+    INSTRUCTION(RPUT): {
+      CHECK_UNDERFLOW(dp, 1);
+      RPUSH(tos);
+      tos = ds[--dp];
+      NEXT(1);
+    }
+    INSTRUCTION(RPEEK): {
+      PUSH(rtos);
+      NEXT(1);
+    }
+    INSTRUCTION(BFETCH): {
+      CHECK_UNDERFLOW(dp, 1);
+      FAULT_POINT();
+      tos = fetch_byte(vm, tos);
+      NEXT(1);
+    }
+    INSTRUCTION(BSTORE): {
+      CHECK_UNDERFLOW(dp, 2);
+      FAULT_POINT();
+      const word address = tos;
+      store_byte(vm, address, DS(1) & 0xFF);
+      dp -= 2;
+      tos = ds[dp];
+      invalidate(vm, address, 1);
+      NEXT(1);
+    }
+    INSTRUCTION(TYPE): {
+      CHECK_UNDERFLOW(dp, 2);
+      const word address = DS(1);
+      const word len = tos;
+      CHECK_RANGE(address, len);
+      put_bytes(vm, &memory[address], len);
+      dp -= 2;
+      tos = ds[dp];
+      NEXT(1);
+    }
+    INSTRUCTION(FIND): {
+      CHECK_UNDERFLOW(dp, 3);
+      const word address = DS(2);
+      const word len = DS(1);
+      CHECK_RANGE(address, len);
+      if (dictionary_sync(vm, tos)) vm_fail(vm);
+      dp -= 2;
+      tos = dictionary_find(vm, address, len);
+      NEXT(1);
+    }
+    INSTRUCTION(MOVE): {
+      CHECK_UNDERFLOW(dp, 3);
+      const word source = DS(2);
+      const word destination = DS(1);
+      const word len = tos;
+      CHECK_RANGE(source, len);
+      CHECK_RANGE(destination, len);
+      memmove(&memory[destination], &memory[source], len);
+      dp -= 3;
+      tos = ds[dp];
+      invalidate(vm, destination, len);
+      NEXT(1);
+    }
+    INSTRUCTION(FILL): {
+      CHECK_UNDERFLOW(dp, 3);
+      const word address = DS(2);
+      const word len = DS(1);
+      CHECK_RANGE(address, len);
+      memset(&memory[address], tos & 0xFF, len);
+      dp -= 3;
+      tos = ds[dp];
+      invalidate(vm, address, len);
+      NEXT(1);
+    }
+    INSTRUCTION(COMPARE): {
+      CHECK_UNDERFLOW(dp, 3);
+      const word a = DS(2);
+      const word b = DS(1);
+      const word len = tos;
+      CHECK_RANGE(a, len);
+      CHECK_RANGE(b, len);
+      const int order = memcmp(&memory[a], &memory[b], len);
+      dp -= 2;
+      tos = order < 0 ? -1 : order > 0;
+      NEXT(1);
+    }
+    INSTRUCTION(PARSE_NUMBER): {
+      CHECK_UNDERFLOW(dp, 3);
+      const word address = DS(2);
+      const word len = DS(1);
+      CHECK_RANGE(address, len);
+      check_base(vm, tos, ip);
+      word n = 0;
+      const enum parse_result result =
+	parse_number(&memory[address], len, tos, &n);
+      --dp;
+      DS(1) = n;
+      tos = result;
+      NEXT(1);
+    }
+    INSTRUCTION(FORMAT_NUMBER): {
+      CHECK_UNDERFLOW(dp, 3);
+      const word address = tos;
+      check_base(vm, DS(1), ip);
+      char buffer[MAX_NUMBER_SIZE];
+      const word len = format_number(DS(2), DS(1), buffer);
+      CHECK_RANGE(address, len);
+      memcpy(&memory[address], buffer, len);
+      dp -= 2;
+      tos = len;
+      invalidate(vm, address, len);
+      NEXT(1);
+    }
+    INSTRUCTION(SAVE): {
+      CHECK_UNDERFLOW(dp, 2);
+      const word address = DS(1);
+      const word len = tos;
+      CHECK_RANGE(address, len);
+      // The snapshot resumes with -1 in place of the file name.
+      --dp;
+      tos = -1;
+      SPILL();
+      if (save_snapshot(vm, address, len, ip + 1)) vm_fail(vm);
+      tos = 0;
+      NEXT(1);
+    }
+    INSTRUCTION(NATIVE): {
+      const word index = cache[ip].operand;
+      if (!valid_native(index)) {
+	dlt_errorf("unknown native function %d at memory location %d",
+		   index, ip);
+	vm_fail(vm);
+      }
+      const struct native *const native = &natives[index];
+      CHECK_UNDERFLOW(dp, native->inputs);
+      // Outputs past the inputs run into the guard page of a full stack.
+      FAULT_POINT();
+      ds[dp] = tos;
+      struct vm_native_call call = {
+	.cells = &ds[dp - native->inputs + 1],
+	.memory = memory,
+	.memory_size = memory_size,
+      };
+      if (native->function(&call)) native_failed(vm, index, ip);
+      dp += native->outputs - native->inputs;
+      tos = ds[dp];
+      if (call.stored_len > 0) {
+	CHECK_RANGE(call.stored, call.stored_len);
+	invalidate(vm, call.stored, call.stored_len);
+      }
+      NEXT(1 + WORD_SIZE);
+    }
+    INSTRUCTION(JUMP): {
+      BRANCH(cache[ip].operand);
+    }
+    INSTRUCTION(CONST_ADD): {
+      CHECK_UNDERFLOW(dp, 1);
+      tos += cache[ip].operand;
+      SKIP();
+    }
+    INSTRUCTION(CONST_SUB): {
+      CHECK_UNDERFLOW(dp, 1);
+      tos -= cache[ip].operand;
+      SKIP();
+    }
+    INSTRUCTION(CONST_EQ): {
+      CHECK_UNDERFLOW(dp, 1);
+      tos = tos == cache[ip].operand ? -1 : 0;
+      SKIP();
+    }
+    INSTRUCTION(CONST_LT): {
+      CHECK_UNDERFLOW(dp, 1);
+      tos = tos < cache[ip].operand ? -1 : 0;
+      SKIP();
+    }
+    INSTRUCTION(CONST_RET): {
+      PUSH(cache[ip].operand);
+      CHECK_UNDERFLOW(rp, 1);
+      const word target = rtos;
+      rtos = rs[--rp];
+      JUMP(target);
+    }
+    INSTRUCTION(ADD_RET): {
+      BINARY(+);
+      CHECK_UNDERFLOW(rp, 1);
+      const word target = rtos;
+      rtos = rs[--rp];
+      JUMP(target);
+    }
+    INSTRUCTION(RPEEK_ADD): {
+      CHECK_UNDERFLOW(dp, 1);
+      tos += rtos;
+      SKIP();
+    }
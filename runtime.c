@@ -1,353 +1,3348 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "diatom.h"
 #include "util.h"
+#include "vm.h"
 
-#define STACK_SIZE  20
-#define MEMORY_SIZE 8000
+// Sizes used unless they are set with -m, -d and -r.
+#define DEFAULT_STACK_SIZE  20
+#define DEFAULT_MEMORY_SIZE 8000
+#define MAX_STACK_SIZE  (1 << 24)
+#define MAX_MEMORY_SIZE (1 << 30)
+#define MAX_THREADS 1024
+// Records kept in the ring buffer of -T.
+#define TRACE_RECORDS (1 << 16)
 #define IO_BUFFER_SIZE 4096
 
 //#define DEBUG
 
 /* Stacks */
+// The cells of a stack are stored in data[1] to data[pointer]. data[0]
+// is never used, which lets the interpreter cache the top of the stack
+// in a local and spill it to data[pointer] without checking whether the
+// stack is empty. data[size] is the last cell before a guard page,
+// which is why pushing onto a full stack does not need to be checked.
 struct stack {
   word pointer;
-  word data[STACK_SIZE];
+  word size;
+  word *data;
 };
 
-inline static void stack_push(struct stack* s, word value) {
-  const word index = s->pointer++;
-  if (index >= STACK_SIZE) dlt_fatal_error("stack overflow");
-  s->data[index] = value;
+/* I/O buffers */
+// Everything the VM prints is collected in an output buffer. It is
+// written out once it is full, before the VM waits for input and when
+// the instance is destroyed.
+struct output {
+  char buffer[IO_BUFFER_SIZE];
+  size_t len;
+};
+
+struct input {
+  char buffer[IO_BUFFER_SIZE];
+  size_t len;
+  size_t cursor;
+};
+
+/* VM State */
+// Everything a running program can change lives in a struct vm, one
+// per instance. What instances of the same image share (the file their
+// memory is mapped from and the results of the verifier) is in a
+// struct vm_image and does not change once the image is loaded.
+
+// Internal opcode that marks the end of memory. It is never emitted by
+// the assembler.
+#define HALT 255
+
+// The longest instruction sequence the decoder fuses into a single
+// superinstruction is 'const -1 cjmp <addr>'.
+#define MAX_INSTRUCTION_SIZE (2 * (1 + WORD_SIZE))
+
+// The padding past memory_size is filled with HALT so that running off
+// the end of memory stops the VM without checking the instruction
+// pointer on every dispatch.
+#define MEMORY_PADDING MAX_INSTRUCTION_SIZE
+
+// A mapping with inaccessible guard pages on either side, see Guarded
+// memory below.
+struct guarded_region {
+  byte *start;
+  size_t size;
+  // The pages between the guards.
+  byte *accessible;
+  size_t accessible_size;
+};
+
+struct vm_image {
+  // Memory of the image, followed by the HALT padding, starts at
+  // memory_offset of file. Images are copied to a temporary file,
+  // snapshots are used as they are.
+  FILE *file;
+  off_t memory_offset;
+  word memory_size;
+  enum cell_order cell_order;
+
+  // State instances start in. The cells of the stacks are only saved
+  // by snapshots, otherwise data is NULL and the stacks are empty.
+  word instruction_pointer;
+  struct stack data_stack;
+  struct stack return_stack;
+
+  // Results of the verifier.
+  bool verified;
+  byte *verification;
+  struct word_bounds *word_bounds;
+};
+
+struct vm {
+  struct vm_image *image;
+  enum vm_status status;
+  char error[ERR_MSG_MAX];
+  // Where vm_run() continues when the program fails.
+  sigjmp_buf failed;
+
+  // Registers
+  // run() keeps the instruction pointer in a local and only stores it
+  // here before instructions that might fault, so that the fault
+  // handler can report where it happened.
+  word instruction_pointer;
+  struct stack data_stack;
+  struct stack return_stack;
+
+  // Memory
+  word memory_size;
+  byte *memory;
+  // Byte order of the cells in the loaded image. Cells are accessed with
+  // single native loads and stores if it matches the host.
+  enum cell_order image_cell_order;
+  bool native_cells;
+  struct guarded_region memory_region;
+  struct guarded_region data_stack_region;
+  struct guarded_region return_stack_region;
+  struct instruction *instruction_cache;
+  size_t instruction_cache_size;
+
+  // I/O
+  struct vm_io io;
+  struct input input;
+  struct output output;
+
+  // Verifier, the tables are the ones of the image.
+  bool verification_enabled;
+  byte *verification;
+  struct word_bounds *word_bounds;
+  // The nodes of all words that are being verified, the innermost one
+  // last. Only used while the image is loaded.
+  struct verify_node *verify_nodes;
+  word verify_node_count;
+  bool verify_nodes_exhausted;
+
+  // Dictionary index
+  struct dictionary_entry *dictionary;
+  size_t dictionary_capacity;
+  size_t dictionary_count;
+  // The newest indexed header or 0 if the table is empty.
+  word dictionary_latest;
+  // Marks the bytes of all indexed headers.
+  bool *dictionary_bytes;
+  // Headers that are about to be added, the newest one first.
+  word *dictionary_pending;
+  size_t dictionary_pending_capacity;
+
+  // JIT
+  bool jit_enabled;
+  struct jit_word *jit_words;
+  // Marks the bytes of all instructions that were compiled.
+  bool *jit_covered;
+  byte *jit_code;
+  size_t jit_code_used;
+  // Range of memory that compiled code stored into. The interpreter
+  // invalidates its instruction cache entries once the code returns.
+  word jit_stored_start;
+  word jit_stored_end;
+
+  // Profiler and tracing, NULL unless they are enabled.
+  struct profile *profile;
+  struct trace *trace;
+
+#ifdef COUNT_INSTRUCTIONS
+  // Instructions dispatched so far, see COUNT_INSTRUCTION().
+  unsigned long long instructions;
+#endif
+};
+
+// The instance that is running on this thread, for the fault handler
+// and the helpers called by compiled code.
+static _Thread_local struct vm *running_vm = NULL;
+
+// Stops the running program, vm_run() reports the last error.
+static _Noreturn void vm_fail(struct vm *vm) {
+  siglongjmp(vm->failed, 1);
+}
+
+static _Noreturn void vm_fatal_error(struct vm *vm, char msg[ERR_MSG_MAX]) {
+  dlt_error(msg);
+  vm_fail(vm);
+}
+
+/* I/O functions */
+static int flush_output(struct vm *vm) {
+  struct output *const o = &vm->output;
+  if (o->len == 0) return 0;
+
+  const size_t len = o->len;
+  o->len = 0;
+  return vm->io.write(vm->io.context, o->buffer, len);
+}
+
+// DEBUG builds print emitted characters along with the trace instead.
+#ifndef DEBUG
+static void put_char(struct vm *vm, byte c) {
+  struct output *const o = &vm->output;
+  if (o->len == sizeof(o->buffer) && flush_output(vm)) vm_fail(vm);
+  o->buffer[o->len++] = (char)c;
+}
+#endif
+
+static void put_bytes(struct vm *vm, const void *bytes, size_t len) {
+  struct output *const o = &vm->output;
+  if (o->len + len > sizeof(o->buffer) && flush_output(vm)) vm_fail(vm);
+  if (len > sizeof(o->buffer)) {
+    if (vm->io.write(vm->io.context, bytes, len)) vm_fail(vm);
+    return;
+  }
+
+  memcpy(&o->buffer[o->len], bytes, len);
+  o->len += len;
+}
+
+// Returns the next character of the input or '\0' at the end of it.
+// The buffer is refilled with whatever input is available, which only
+// blocks if there is none. Pending output is flushed before that, so
+// that e.g. a prompt is visible while the VM waits.
+static byte next_char(struct vm *vm) {
+  struct input *const i = &vm->input;
+  if (i->cursor >= i->len) {
+    if (flush_output(vm)) vm_fail(vm);
+
+    const long len = vm->io.read(vm->io.context, i->buffer,
+				 sizeof(i->buffer));
+    if (len == 0) return '\0';
+    if (len < 0) vm_fail(vm);
+
+    i->len = len;
+    i->cursor = 0;
+  }
+
+  return (byte)i->buffer[i->cursor++];
+}
+
+static long read_stdin(void *context, char *buffer, size_t len) {
+  (void)context;
+  ssize_t read_len = 0;
+  do {
+    read_len = read(STDIN_FILENO, buffer, len);
+  } while (read_len < 0 && errno == EINTR);
+  if (read_len < 0) return dlt_error("failed to read from stdin");
+
+  return read_len;
+}
+
+static int write_stdout(void *context, const char *buffer, size_t len) {
+  (void)context;
+  if (fwrite(buffer, sizeof(buffer[0]), len, stdout) != len || fflush(stdout))
+    return dlt_error("failed to write to stdout");
+
+  return 0;
+}
+
+static const struct vm_io stdio_io = {
+  .read = read_stdin,
+  .write = write_stdout,
+  .context = NULL,
+};
+
+/* Guarded memory */
+// Memory and both stacks are mapped between inaccessible guard pages.
+// Instructions do not compare addresses or stack depths against their
+// bounds, an access past them faults instead and on_fault reports it
+// as an error of the running program.
+//
+// Memory sits in the middle of a reservation that spans every offset
+// a cell can hold, so any address an instruction computes either hits
+// memory or a guard page. Reserving address space without backing it
+// is cheap, but needs a 64-bit host.
+#if SIZE_MAX > 0xFFFFFFFF
+#define MEMORY_GUARD_SIZE ((size_t)1 << 31)
+#else
+#define MEMORY_GUARD_SIZE ((size_t)0)
+#endif
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+static size_t round_to_pages(size_t size) {
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  return (size + page_size - 1) / page_size * page_size;
+}
+
+// Maps size bytes (rounded up to whole pages) with at least guard
+// bytes and one page of guard on either side.
+static int map_guarded(struct guarded_region *r, size_t guard, size_t size) {
+  guard = round_to_pages(guard + 1);
+  size = round_to_pages(size);
+
+  r->size = guard + size + guard;
+  r->start = mmap(NULL, r->size, PROT_NONE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (r->start == MAP_FAILED) {
+    r->start = NULL;
+    return dlt_error("failed to map memory");
+  }
+
+  r->accessible = r->start + guard;
+  r->accessible_size = size;
+  if (mprotect(r->accessible, size, PROT_READ | PROT_WRITE))
+    return dlt_error("failed to map memory");
+
+  return 0;
+}
+
+static void unmap_guarded(struct guarded_region *r) {
+  if (r->start != NULL) munmap(r->start, r->size);
+}
+
+static bool in_guard(const struct guarded_region *r, const byte *addr) {
+  return r->start != NULL && addr >= r->start && addr < r->start + r->size &&
+    (addr < r->accessible || addr >= r->accessible + r->accessible_size);
+}
+
+static int map_stack(struct stack *s, struct guarded_region *r) {
+  if (map_guarded(r, 0, (s->size + 1) * sizeof(word))) return -1;
+
+  // Align the end of data[] with the guard page above it.
+  s->data = (word*)(r->accessible + r->accessible_size) - (s->size + 1);
+  return 0;
+}
+
+// Maps the memory of an instance copy-on-write from its image and both
+// stacks. Pages of memory are shared with the other instances until
+// the instance stores into them.
+static int map_vm(struct vm *vm) {
+  const size_t memory_len = vm->memory_size + MEMORY_PADDING;
+  if (map_guarded(&vm->memory_region, MEMORY_GUARD_SIZE, memory_len))
+    return -1;
+  vm->memory = vm->memory_region.accessible;
+  if (mmap(vm->memory, memory_len, PROT_READ | PROT_WRITE,
+	   MAP_PRIVATE | MAP_FIXED, fileno(vm->image->file),
+	   vm->image->memory_offset) == MAP_FAILED)
+    return dlt_error("failed to map image");
+
+  if (map_stack(&vm->data_stack, &vm->data_stack_region)) return -1;
+  return map_stack(&vm->return_stack, &vm->return_stack_region);
+}
+
+static void on_fault(int signal_number, siginfo_t *info, void *context) {
+  (void)context;
+  const byte *const addr = info->si_addr;
+  struct vm *const vm = running_vm;
+
+  const char *reason = NULL;
+  if (vm == NULL)
+    reason = NULL;
+  else if (in_guard(&vm->memory_region, addr))
+    reason = "memory access out of bounds";
+  else if (in_guard(&vm->data_stack_region, addr))
+    reason = addr < vm->data_stack_region.accessible ?
+      "stack underflow" : "stack overflow";
+  else if (in_guard(&vm->return_stack_region, addr))
+    reason = addr < vm->return_stack_region.accessible ?
+      "return stack underflow" : "return stack overflow";
+
+  if (reason == NULL) {
+    // Not caused by the VM, let the faulting access crash the process.
+    signal(signal_number, SIG_DFL);
+    return;
+  }
+
+  // The fault comes from a load or store of an instruction and not
+  // from within the C library, so it can be reported like any other
+  // error.
+  dlt_errorf("%s at memory location %d", reason, vm->instruction_pointer);
+  vm_fail(vm);
+}
+
+static void out_of_bounds(struct vm *vm, word ip) {
+  dlt_errorf("memory access out of bounds at memory location %d", ip);
+  vm_fail(vm);
+}
+
+static int handle_faults(void) {
+  // The handler leaves through vm_fail(), so the signal must not stay
+  // blocked afterwards.
+  struct sigaction action = { .sa_flags = SA_SIGINFO | SA_NODEFER };
+  action.sa_sigaction = on_fault;
+  sigemptyset(&action.sa_mask);
+
+  // Some systems raise SIGBUS instead of SIGSEGV for guard pages.
+  if (sigaction(SIGSEGV, &action, NULL) || sigaction(SIGBUS, &action, NULL))
+    return dlt_error("failed to install fault handler");
+
+  return 0;
+}
+
+static byte fetch_byte(const struct vm *vm, word addr) {
+  return vm->memory[addr];
+}
+
+static void store_byte(struct vm *vm, word addr, byte b) {
+  vm->memory[addr] = b;
+}
+
+static word fetch_word(const struct vm *vm, word addr) {
+  word w = 0;
+  if (vm->native_cells) {
+    memcpy(&w, &vm->memory[addr], sizeof(w));
+    return w;
+  }
+
+  for (unsigned int i = 0; i < WORD_SIZE; ++i) {
+    word b = (word)fetch_byte(vm, addr + i);
+    if (vm->image_cell_order == CELLS_BIG_ENDIAN)
+      w |= (b << (WORD_SIZE - (i+1)) * 8);
+    else
+      w |= (b << i * 8);
+  }
+
+  return w;
+}
+
+static void store_word(struct vm *vm, word addr, word w) {
+  if (vm->native_cells) {
+    memcpy(&vm->memory[addr], &w, sizeof(w));
+    return;
+  }
+
+  byte buf[WORD_SIZE] = { 0 };
+  word_to_bytes(w, buf, vm->image_cell_order);
+
+  for (unsigned int i = 0; i < WORD_SIZE; ++i)
+    store_byte(vm, addr + i, buf[i]);
+}
+
+/* Dispatch */
+// By default the interpreter uses computed gotos (labels-as-values)
+// with the dispatch replicated at the end of every handler, so each
+// instruction gets its own indirect branch and branch history. Define
+// SWITCH_DISPATCH to fall back to a portable switch statement.
+#if defined(__GNUC__) && !defined(SWITCH_DISPATCH) && !defined(DEBUG)
+#define THREADED_DISPATCH
+#endif
+
+// Internal pseudo-opcode of instruction cache entries that have not
+// been decoded yet.
+#define DECODE 256
+// Internal pseudo-opcodes of calls that go through the JIT.
+#define JIT_CALL 257
+#define JIT_SCALL 258
+// Internal pseudo-opcode of instructions that are recorded before they
+// run, see Tracing.
+#define TRACE 259
+// The handlers without stack checks of verified instructions are
+// numbered from UNCHECKED on.
+#define UNCHECKED 260
+#define DISPATCH_TABLE_SIZE (2 * UNCHECKED)
+
+// Instructions with a handler in instructions.h.
+#define INSTRUCTIONS(X)							\
+  X(EXIT) X(NOP) X(RETURN) X(CONST) X(FETCH) X(STORE) X(ADD)		\
+  X(SUBTRACT) X(MULTIPLY) X(DIVIDE) X(MOD) X(DUP) X(DROP) X(SWAP)	\
+  X(OVER) X(CJUMP) X(CALL) X(SCALL) X(KEY) X(EMIT) X(EQUALS) X(NOT)	\
+  X(AND) X(OR) X(LT) X(GT) X(RPOP) X(RPUT) X(RPEEK) X(BFETCH)		\
+  X(BSTORE) X(JUMP) X(CONST_ADD) X(CONST_SUB) X(CONST_EQ) X(CONST_LT)	\
+  X(CONST_RET) X(ADD_RET) X(RPEEK_ADD) X(TYPE) X(FIND)			\
+  X(MOVE) X(FILL) X(COMPARE) X(PARSE_NUMBER) X(FORMAT_NUMBER)		\
+  X(SAVE) X(NATIVE)
+
+// Handlers are stored relative to the one of DECODE, as the offset of
+// their label or their opcode. Zeroed instruction cache entries are
+// therefore undecoded.
+typedef int handler;
+#define UNDECODED 0
+
+#ifdef THREADED_DISPATCH
+#define INSTRUCTION(name) op_##name
+#define HANDLER(name) ((handler)(__extension__ (&&op_##name - &&op_DECODE)))
+#define HANDLER_FOR(opcode) dispatch_table[opcode]
+#define UNCHECKED_HANDLER(name)						\
+  ((handler)(__extension__ (&&op_##name##_unchecked - &&op_DECODE)))
+#define DISPATCH()							\
+  __extension__ ({ goto *(&&op_DECODE + cache[ip].handler); })
+#else
+#define INSTRUCTION(name) case name
+#define HANDLER(name) ((name) - DECODE)
+#define HANDLER_FOR(opcode) ((opcode) - DECODE)
+#define UNCHECKED_HANDLER(name) ((name) + UNCHECKED - DECODE)
+#define DISPATCH() continue
+#endif
+
+/* Instruction cache */
+// memory[] is lazily decoded into a side array with one entry per
+// address. Each entry holds the handler of the instruction starting
+// at that address and its inline operand, already assembled from the
+// following bytes. Stores into memory invalidate the entries they
+// overlap so self-modifying code (e.g. words compiled at 'here') is
+// decoded again on its next execution.
+//
+// The decoder also fuses the raw instruction sequences of the
+// superinstructions in diatom.h, so images that were not assembled
+// with them benefit as well. Jumps into the middle of such a sequence
+// still find the plain instruction in the entry of their target.
+struct instruction {
+  handler handler;
+  word operand;
+  // Number of bytes the decoded instruction spans in memory.
+  word size;
+};
+
+// Zeroed entries still have to be decoded (see UNDECODED), so only the
+// pages for code an instance actually runs take up memory.
+static int map_instruction_cache(struct vm *vm) {
+  vm->instruction_cache_size =
+    (vm->memory_size + MEMORY_PADDING) * sizeof(*vm->instruction_cache);
+  vm->instruction_cache = mmap(NULL, vm->instruction_cache_size,
+			       PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			       -1, 0);
+  if (vm->instruction_cache == MAP_FAILED) {
+    vm->instruction_cache = NULL;
+    return dlt_error("failed to map instruction cache");
+  }
+
+  return 0;
+}
+
+// Operands of branches are resolved to addresses inside of memory.
+// Targets outside of memory point to the HALT padding instead.
+static word branch_target(const struct vm *vm, word target) {
+  if ((unsigned int)target >= (unsigned int)vm->memory_size)
+    return vm->memory_size;
+  return target;
+}
+
+// Number of bytes of the inline operand of an instruction with one.
+static word operand_size(byte opcode) {
+  switch (opcode) {
+  case CONST8: case JUMP8: case CJUMP8: return 1;
+  case CONST16: case CALL16: return 2;
+  default: return WORD_SIZE;
+  }
+}
+
+// Reads the sign-extended operand of len bytes at addr.
+static word fetch_operand(const struct vm *vm, word addr, word len) {
+  if (len == (word)WORD_SIZE) return fetch_word(vm, addr);
+
+  unsigned int w = 0;
+  for (word i = 0; i < len; ++i) {
+    const unsigned int b = fetch_byte(vm, addr + i);
+    if (vm->image_cell_order == CELLS_BIG_ENDIAN) w = (w << 8) | b;
+    else w |= b << (i * 8);
+  }
+  const unsigned int sign = 1u << (8 * len - 1);
+  return (word)((w ^ sign) - sign);
+}
+
+// Fills in the target and size of the branch or call at addr. The
+// targets of the short forms are relative to their opcode.
+static void decode_branch(const struct vm *vm, word addr,
+			  struct instruction *i) {
+  const word len = operand_size(vm->memory[addr]);
+  word target = fetch_operand(vm, addr + 1, len);
+  if (len < (word)WORD_SIZE) target += addr;
+
+  i->operand = branch_target(vm, target);
+  i->size = 1 + len;
+}
+
+// decode fills in the operand and size of the instruction at addr and
+// returns its opcode, which might be a superinstruction fused from
+// the raw bytes. The short forms decode to the instructions they
+// abbreviate.
+static int decode(const struct vm *vm, word addr, struct instruction *i) {
+  int opcode = vm->memory[addr];
+  i->operand = 0;
+  i->size = 1;
+
+  switch (opcode) {
+  case CONST:
+  case CONST8:
+  case CONST16: {
+    const word len = operand_size(opcode);
+    const word value = fetch_operand(vm, addr + 1, len);
+    const word next = addr + 1 + len;
+
+    opcode = CONST;
+    i->operand = value;
+    i->size = 1 + len;
+    switch (vm->memory[next]) {
+    case CJUMP:
+    case CJUMP8: {
+      if (value != -1) break;
+      struct instruction branch;
+      decode_branch(vm, next, &branch);
+      opcode = JUMP;
+      i->operand = branch.operand;
+      i->size += branch.size;
+      break;
+    }
+    case ADD: opcode = CONST_ADD; ++i->size; break;
+    case SUBTRACT: opcode = CONST_SUB; ++i->size; break;
+    case EQUALS: opcode = CONST_EQ; ++i->size; break;
+    case LT: opcode = CONST_LT; ++i->size; break;
+    case RETURN: opcode = CONST_RET; ++i->size; break;
+    }
+    break;
+  }
+  case ADD:
+    if (vm->memory[addr + 1] == RETURN) {
+      opcode = ADD_RET;
+      i->size = 2;
+    }
+    break;
+  case RPEEK:
+    if (vm->memory[addr + 1] == ADD) {
+      opcode = RPEEK_ADD;
+      i->size = 2;
+    }
+    break;
+  case JUMP:
+  case JUMP8:
+    opcode = JUMP;
+    decode_branch(vm, addr, i);
+    break;
+  case CJUMP:
+  case CJUMP8:
+    opcode = CJUMP;
+    decode_branch(vm, addr, i);
+    break;
+  case CALL:
+  case CALL16:
+    opcode = CALL;
+    decode_branch(vm, addr, i);
+    break;
+  case NATIVE:
+  case CONST_ADD:
+  case CONST_SUB:
+  case CONST_EQ:
+  case CONST_LT:
+  case CONST_RET:
+    i->operand = fetch_word(vm, addr + 1);
+    i->size = 1 + WORD_SIZE;
+    break;
+  }
+
+  return opcode;
+}
+
+/* Stack effects */
+// Number of cells an instruction needs on the data and return stack
+// and by how much it changes their depth.
+struct stack_effect {
+  byte inputs;
+  signed char delta;
+  byte rinputs;
+  signed char rdelta;
+};
+
+static const struct stack_effect stack_effects[INSTRUCTION_COUNT] = {
+  [EXIT] = { 0, 0, 0, 0 },
+  [NOP] = { 0, 0, 0, 0 },
+  [RETURN] = { 0, 0, 1, -1 },
+  [CONST] = { 0, 1, 0, 0 },
+  [FETCH] = { 1, 0, 0, 0 },
+  [STORE] = { 2, -2, 0, 0 },
+  [ADD] = { 2, -1, 0, 0 },
+  [SUBTRACT] = { 2, -1, 0, 0 },
+  [MULTIPLY] = { 2, -1, 0, 0 },
+  [DIVIDE] = { 2, -1, 0, 0 },
+  [MOD] = { 2, -1, 0, 0 },
+  [DUP] = { 1, 1, 0, 0 },
+  [DROP] = { 1, -1, 0, 0 },
+  [SWAP] = { 2, 0, 0, 0 },
+  [OVER] = { 2, 1, 0, 0 },
+  [CJUMP] = { 1, -1, 0, 0 },
+  [CALL] = { 0, 0, 0, 1 },
+  [SCALL] = { 1, -1, 0, 1 },
+  [KEY] = { 0, 1, 0, 0 },
+  [EMIT] = { 1, -1, 0, 0 },
+  [EQUALS] = { 2, -1, 0, 0 },
+  [NOT] = { 1, 0, 0, 0 },
+  [AND] = { 2, -1, 0, 0 },
+  [OR] = { 2, -1, 0, 0 },
+  [LT] = { 2, -1, 0, 0 },
+  [GT] = { 2, -1, 0, 0 },
+  [RPOP] = { 0, 1, 1, -1 },
+  [RPUT] = { 1, -1, 0, 1 },
+  [RPEEK] = { 0, 1, 1, 0 },
+  [BFETCH] = { 1, 0, 0, 0 },
+  [BSTORE] = { 2, -2, 0, 0 },
+  [JUMP] = { 0, 0, 0, 0 },
+  [CONST_ADD] = { 1, 0, 0, 0 },
+  [CONST_SUB] = { 1, 0, 0, 0 },
+  [CONST_EQ] = { 1, 0, 0, 0 },
+  [CONST_LT] = { 1, 0, 0, 0 },
+  [CONST_RET] = { 0, 1, 1, -1 },
+  [ADD_RET] = { 2, -1, 1, -1 },
+  [RPEEK_ADD] = { 1, 0, 1, 0 },
+  [TYPE] = { 2, -2, 0, 0 },
+  [FIND] = { 3, -2, 0, 0 },
+  [MOVE] = { 3, -3, 0, 0 },
+  [FILL] = { 3, -3, 0, 0 },
+  [COMPARE] = { 3, -2, 0, 0 },
+  [PARSE_NUMBER] = { 3, -1, 0, 0 },
+  [FORMAT_NUMBER] = { 3, -2, 0, 0 },
+  [SAVE] = { 2, -1, 0, 0 },
+  // Each native function has its own, see Natives.
+  [NATIVE] = { 0, 0, 0, 0 },
+};
+
+/* Natives */
+// 'native <index>' calls a C function from the table below, e.g. a hot
+// kernel that would take many instructions to interpret. The built-in
+// functions are listed in diatom.h and programs embedding the runtime
+// can append their own with vm_register_native(). Every function
+// declares how many cells it takes and returns. Checked code checks
+// them against the stacks before the call and the verifier treats the
+// call like any other instruction with that stack effect.
+//
+// Faults of a native function in the guard pages around memory and the
+// stacks are reported like the ones of instructions.
+#define MAX_NATIVES 256
+
+struct native {
+  vm_native_function function;
+  byte inputs;
+  byte outputs;
+};
+
+static int native_pow(struct vm_native_call *call) {
+  // Arithmetic wraps on overflow, like in compiled words.
+  unsigned int x = call->cells[0];
+  const word n = call->cells[1];
+  unsigned int result = n < 0 ? x : 1;
+  for (word e = n; e > 0; e >>= 1) {
+    if (e & 1) result *= x;
+    x *= x;
+  }
+
+  call->cells[0] = result;
+  return 0;
+}
+
+static int native_divmod(struct vm_native_call *call) {
+  const word a = call->cells[0];
+  const word b = call->cells[1];
+  if (b == 0) return dlt_error("division by zero");
+
+  if (a == INT_MIN && b == -1) {
+    call->cells[0] = 0;
+    call->cells[1] = INT_MIN;
+  } else {
+    call->cells[0] = a % b;
+    call->cells[1] = a / b;
+  }
+  return 0;
+}
+
+static int native_scan(struct vm_native_call *call) {
+  const word address = call->cells[0];
+  const word len = call->cells[1];
+  if (len < 0 || address < 0 || address > call->memory_size - len)
+    return dlt_error("memory access out of bounds");
+
+  const byte *const found =
+    memchr(&call->memory[address], call->cells[2] & 0xFF, len);
+  call->cells[0] = found != NULL ? found - &call->memory[address] : -1;
+  return 0;
+}
+
+static struct native natives[MAX_NATIVES] = {
+  [NATIVE_POW] = { native_pow, 2, 1 },
+  [NATIVE_DIVMOD] = { native_divmod, 2, 2 },
+  [NATIVE_SCAN] = { native_scan, 3, 1 },
+};
+static word native_count = BUILTIN_NATIVE_COUNT;
+
+int vm_register_native(vm_native_function function, byte inputs, byte outputs) {
+  if (function == NULL) return dlt_error("missing native function");
+  if (inputs > VM_NATIVE_MAX_CELLS || outputs > VM_NATIVE_MAX_CELLS)
+    return dlt_error("native function takes or returns too many cells");
+  if (native_count == MAX_NATIVES)
+    return dlt_error("maximum number of native functions reached");
+
+  natives[native_count] = (struct native) { function, inputs, outputs };
+  return native_count++;
+}
+
+static bool valid_native(word index) {
+  return (unsigned int)index < (unsigned int)native_count;
+}
+
+static _Noreturn void native_failed(struct vm *vm, word index, word ip) {
+  char reason[ERR_MSG_MAX] = "";
+  strlcpy(reason, error_msg, sizeof(reason));
+  dlt_errorf("native function %d failed at memory location %d: %s",
+	     index, ip, reason);
+  vm_fail(vm);
+}
+
+/* Numbers */
+#define MIN_BASE 2
+#define MAX_BASE 36
+// A cell in base 2 plus the sign.
+#define MAX_NUMBER_SIZE (8 * WORD_SIZE + 1)
+
+enum parse_result {
+  NUMBER_OK = 0,
+  NOT_A_NUMBER = -1,
+  NUMBER_OVERFLOW = -2,
+};
+
+static int digit_value(byte c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'z') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'Z') return c - 'A' + 10;
+  return MAX_BASE;
+}
+
+// Parses the len bytes at s as an optionally negative number. Numbers
+// that do not fit into a cell are reported instead of wrapped.
+static enum parse_result parse_number(const byte *s, word len, word base,
+				      word *n) {
+  const bool negative = len > 0 && s[0] == '-';
+  word i = negative ? 1 : 0;
+  if (i == len) return NOT_A_NUMBER;
+
+  // The magnitude of the most negative cell is one more than the one
+  // of the most positive cell.
+  const unsigned int max = negative ? (unsigned int)INT_MAX + 1 : INT_MAX;
+  unsigned int magnitude = 0;
+  for (; i < len; ++i) {
+    const int digit = digit_value(s[i]);
+    if (digit >= base) return NOT_A_NUMBER;
+    if (magnitude > (max - digit) / base) return NUMBER_OVERFLOW;
+    magnitude = magnitude * base + digit;
+  }
+
+  *n = negative ? (word)(0u - magnitude) : (word)magnitude;
+  return NUMBER_OK;
+}
+
+// Writes n to buffer and returns the number of bytes written.
+static word format_number(word n, word base, char buffer[MAX_NUMBER_SIZE]) {
+  unsigned int magnitude = n < 0 ? 0u - (unsigned int)n : (unsigned int)n;
+  char digits[MAX_NUMBER_SIZE];
+  word count = 0;
+  do {
+    digits[count++] = "0123456789abcdefghijklmnopqrstuvwxyz"[magnitude % base];
+    magnitude /= base;
+  } while (magnitude > 0);
+
+  word len = 0;
+  if (n < 0) buffer[len++] = '-';
+  while (count > 0) buffer[len++] = digits[--count];
+
+  return len;
+}
+
+static void check_base(struct vm *vm, word base, word ip) {
+  if (base < MIN_BASE || base > MAX_BASE) {
+    dlt_errorf("invalid base %d at memory location %d", base, ip);
+    vm_fail(vm);
+  }
+}
+
+/* Dictionary index */
+// 'find' looks up words in a hash table of the dictionary headers
+// instead of walking their linked list:
+//
+//   +------+-----+------+------+
+//   | link | len | name | code |
+//   +------+-----+------+------+
+//
+// The table is brought up to date lazily. When find is passed a newer
+// latest header than the one the table was built for, the headers in
+// between are added oldest first, so newer headers shadow older ones
+// with the same name. If the table's latest header is not in the list
+// anymore (e.g. latest was set back) the table is rebuilt. Stores into
+// an indexed header throw the table away.
+#define IMMEDIATE_FLAG 128
+#define DICTIONARY_MIN_CAPACITY 256
+
+struct dictionary_entry {
+  // Address of the header or 0 if the slot is free.
+  word header;
+  unsigned int hash;
+};
+
+static unsigned int hash_name(const struct vm *vm, word addr, word len) {
+  // FNV-1a
+  unsigned int hash = 2166136261u;
+  for (word i = 0; i < len; ++i)
+    hash = (hash ^ vm->memory[addr + i]) * 16777619u;
+
+  return hash;
+}
+
+static word header_name_len(const struct vm *vm, word header) {
+  return vm->memory[header + WORD_SIZE] & ~IMMEDIATE_FLAG;
+}
+
+static word header_name(word header) {
+  return header + WORD_SIZE + 1;
+}
+
+static bool valid_header(const struct vm *vm, word header) {
+  return header > 0 && header < vm->memory_size - (word)WORD_SIZE &&
+    header_name(header) + header_name_len(vm, header) <= vm->memory_size;
+}
+
+// Returns the slot of the header with the given name or the free slot
+// it would go into.
+static struct dictionary_entry *dictionary_slot(const struct vm *vm,
+						word addr, word len,
+						unsigned int hash) {
+  const size_t mask = vm->dictionary_capacity - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    struct dictionary_entry *const e = &vm->dictionary[i];
+    if (e->header == 0) return e;
+    if (e->hash == hash && header_name_len(vm, e->header) == len &&
+	memcmp(&vm->memory[header_name(e->header)], &vm->memory[addr],
+	       len) == 0)
+      return e;
+  }
+}
+
+static int dictionary_grow(struct vm *vm) {
+  struct dictionary_entry *const old = vm->dictionary;
+  const size_t old_capacity = vm->dictionary_capacity;
+
+  if (vm->dictionary_bytes == NULL) {
+    vm->dictionary_bytes = calloc(vm->memory_size,
+				  sizeof(*vm->dictionary_bytes));
+    if (vm->dictionary_bytes == NULL)
+      return dlt_error("failed to grow dictionary index");
+  }
+
+  vm->dictionary_capacity = old_capacity ? 2 * old_capacity :
+    DICTIONARY_MIN_CAPACITY;
+  vm->dictionary = calloc(vm->dictionary_capacity, sizeof(*vm->dictionary));
+  if (vm->dictionary == NULL)
+    return dlt_error("failed to grow dictionary index");
+
+  for (size_t i = 0; i < old_capacity; ++i) {
+    const struct dictionary_entry e = old[i];
+    if (e.header == 0) continue;
+    *dictionary_slot(vm, header_name(e.header),
+		     header_name_len(vm, e.header), e.hash) = e;
+  }
+  free(old);
+
+  return 0;
+}
+
+// Adds a header, replacing an older one with the same name.
+static int dictionary_add(struct vm *vm, word header) {
+  if (2 * (vm->dictionary_count + 1) > vm->dictionary_capacity &&
+      dictionary_grow(vm))
+    return -1;
+
+  const word name = header_name(header);
+  const word len = header_name_len(vm, header);
+  const unsigned int hash = hash_name(vm, name, len);
+  struct dictionary_entry *const e = dictionary_slot(vm, name, len, hash);
+  if (e->header == 0) ++vm->dictionary_count;
+  *e = (struct dictionary_entry) { .header = header, .hash = hash };
+
+  for (word i = header; i < name + len; ++i)
+    vm->dictionary_bytes[i] = true;
+
+  return 0;
+}
+
+static void dictionary_reset(struct vm *vm) {
+  if (vm->dictionary_count == 0) return;
+
+  memset(vm->dictionary, 0,
+	 vm->dictionary_capacity * sizeof(*vm->dictionary));
+  memset(vm->dictionary_bytes, false,
+	 vm->memory_size * sizeof(*vm->dictionary_bytes));
+  vm->dictionary_count = 0;
+  vm->dictionary_latest = 0;
+}
+
+// Indexes the headers that were linked in front of the indexed ones.
+static int dictionary_sync(struct vm *vm, word latest) {
+  if (latest == vm->dictionary_latest) return 0;
+
+  size_t pending = 0;
+  word header = latest;
+  while (header != 0 && header != vm->dictionary_latest) {
+    // A list longer than memory can hold headers has a cycle.
+    if (!valid_header(vm, header) || pending == (size_t)vm->memory_size)
+      return dlt_error("invalid dictionary");
+
+    if (pending == vm->dictionary_pending_capacity) {
+      vm->dictionary_pending_capacity = pending ? 2 * pending : 64;
+      vm->dictionary_pending = realloc(vm->dictionary_pending,
+				       vm->dictionary_pending_capacity *
+				       sizeof(*vm->dictionary_pending));
+      if (vm->dictionary_pending == NULL)
+	return dlt_error("failed to grow dictionary index");
+    }
+    vm->dictionary_pending[pending++] = header;
+    header = fetch_word(vm, header);
+  }
+
+  // The whole list has been walked.
+  if (header == 0) dictionary_reset(vm);
+
+  while (pending > 0)
+    if (dictionary_add(vm, vm->dictionary_pending[--pending])) return -1;
+  vm->dictionary_latest = latest;
+
+  return 0;
+}
+
+// Returns the newest header with the name at addr or 0.
+static word dictionary_find(const struct vm *vm, word addr, word len) {
+  if (vm->dictionary_count == 0) return 0;
+  return dictionary_slot(vm, addr, len, hash_name(vm, addr, len))->header;
+}
+
+// Throws the table away if a store changed an indexed header.
+static void dictionary_store(struct vm *vm, word addr, word len) {
+  if (vm->dictionary_count == 0) return;
+
+  word end = addr + len;
+  if (addr < 0) addr = 0;
+  if (end > vm->memory_size) end = vm->memory_size;
+  for (word i = addr; i < end; ++i) {
+    if (vm->dictionary_bytes[i]) {
+      dictionary_reset(vm);
+      return;
+    }
+  }
+}
+
+/* Verifier */
+// When an image is loaded, the code reachable from its entry point is
+// walked word by word, following branches and calls. A word verifies
+// if the stack depths are the same on every path to each of its
+// instructions, it only calls verified words and it leaves the return
+// address alone. Its maximum stack depths are recorded and its
+// instructions are executed by handlers without stack checks. The
+// bounds of the whole word are checked once when it is called from
+// checked code instead, which reports a stack error on entry if any
+// path through the word could run into one.
+//
+// Instructions that can also be reached from unverified words (e.g.
+// words using scall) keep the checked handlers, as do all words that
+// are only reached through scall, like the ones executed by
+// 'interpret'. Storing into verified code or scalling into the middle
+// of a verified word turns verification off for the rest of the run.
+// Jumping into a verified word through a return address that was
+// manipulated on the return stack is not detected.
+
+enum verification {
+  // The instruction is part of a verified word.
+  VERIFIED = 1,
+  // The instruction can also be reached from unverified code.
+  REACHED_UNVERIFIED = 2,
+  // A verified word starts at this address.
+  VERIFIED_ENTRY = 4,
+  // The byte belongs to a verified instruction.
+  VERIFIED_BYTE = 8,
+};
+
+enum word_state { UNVISITED, VERIFYING, VERIFIED_WORD, UNVERIFIABLE };
+
+struct word_bounds {
+  enum word_state state;
+  // Cells the word needs on the data stack and the maximum number of
+  // cells it adds to the data and return stack.
+  word inputs;
+  word growth;
+  word rgrowth;
+  // Whether the word returns at all and whether its effect on the
+  // depth of the data stack is the same on every path.
+  bool returns;
+  bool balanced;
+  word delta;
+};
+
+struct verify_node {
+  word addr;
+  word depth;
+  word rdepth;
+};
+
+// Adds the instruction at addr to the nodes of the word starting at
+// base unless it has already been reached with the same stack depths.
+static int verify_visit(struct vm *vm, word base, word addr, word depth,
+			word rdepth) {
+  for (word i = base; i < vm->verify_node_count; ++i) {
+    const struct verify_node *const node = &vm->verify_nodes[i];
+    if (node->addr != addr) continue;
+    if (node->depth != depth || node->rdepth != rdepth) return -1;
+    return 0;
+  }
+
+  if (vm->verify_node_count == vm->memory_size) {
+    vm->verify_nodes_exhausted = true;
+    return -1;
+  }
+  vm->verify_nodes[vm->verify_node_count++] = (struct verify_node) {
+    .addr = addr, .depth = depth, .rdepth = rdepth
+  };
+
+  return 0;
+}
+
+static const struct word_bounds *verify_word(struct vm *vm, word entry);
+
+static int verify_walk(struct vm *vm, word base, struct word_bounds *w) {
+  for (word n = base; n < vm->verify_node_count; ++n) {
+    const struct verify_node node = vm->verify_nodes[n];
+    struct instruction i;
+    const int opcode = decode(vm, node.addr, &i);
+    if (opcode >= INSTRUCTION_COUNT || opcode == SCALL) return -1;
+
+    struct stack_effect effect = stack_effects[opcode];
+    if (opcode == NATIVE) {
+      if (!valid_native(i.operand)) return -1;
+      const struct native *const native = &natives[i.operand];
+      effect.inputs = native->inputs;
+      effect.delta = native->outputs - native->inputs;
+    }
+    word growth = effect.delta;
+    word rgrowth = effect.rdelta;
+    bool returns = opcode == RETURN || opcode == CONST_RET || opcode == ADD_RET;
+    if (opcode == CALL) {
+      // The return address is pushed on top of the caller's cells.
+      const struct word_bounds *const callee = verify_word(vm, i.operand);
+      if (callee->state != VERIFIED_WORD) return -1;
+      if (callee->returns && !callee->balanced) return -1;
+
+      effect = (struct stack_effect) { callee->inputs, callee->delta, 0, 0 };
+      growth = callee->growth;
+      rgrowth = 1 + callee->rgrowth;
+    }
+
+    // Cells below the return address must not be touched and only the
+    // return address itself can be returned to.
+    if (returns ? node.rdepth != 0 : node.rdepth < effect.rinputs) return -1;
+
+    const word depth = node.depth + effect.delta;
+    const word rdepth = node.rdepth + effect.rdelta;
+    if (effect.inputs - node.depth > w->inputs)
+      w->inputs = effect.inputs - node.depth;
+    if (node.depth + growth > w->growth) w->growth = node.depth + growth;
+    if (node.rdepth + rgrowth > w->rgrowth) w->rgrowth = node.rdepth + rgrowth;
+
+    if (returns) {
+      if (w->returns && depth != w->delta) w->balanced = false;
+      w->returns = true;
+      w->delta = depth;
+      continue;
+    }
+
+    switch (opcode) {
+    case EXIT:
+      continue;
+    case CALL:
+      if (!vm->word_bounds[i.operand].returns) continue;
+      break;
+    case JUMP:
+      if (verify_visit(vm, base, i.operand, depth, rdepth)) return -1;
+      continue;
+    case CJUMP:
+      if (verify_visit(vm, base, i.operand, depth, rdepth)) return -1;
+      break;
+    }
+    if (verify_visit(vm, base, node.addr + i.size, depth, rdepth)) return -1;
+  }
+
+  return 0;
+}
+
+// Marks all instructions reachable from entry as reachable from
+// unverified code.
+static void verify_unverified(struct vm *vm, word entry) {
+  const word base = vm->verify_node_count;
+  verify_visit(vm, base, entry, 0, 0);
+  for (word n = base; n < vm->verify_node_count; ++n) {
+    const word addr = vm->verify_nodes[n].addr;
+    struct instruction i;
+    const int opcode = decode(vm, addr, &i);
+    vm->verification[addr] |= REACHED_UNVERIFIED;
+
+    switch (opcode) {
+    case EXIT:
+    case RETURN:
+    case CONST_RET:
+    case ADD_RET:
+      continue;
+    case CALL: {
+      const struct word_bounds *const callee = verify_word(vm, i.operand);
+      if (callee->state == VERIFIED_WORD && !callee->returns) continue;
+      break;
+    }
+    case JUMP:
+      verify_visit(vm, base, i.operand, 0, 0);
+      continue;
+    case CJUMP:
+      verify_visit(vm, base, i.operand, 0, 0);
+      break;
+    }
+    if (opcode >= INSTRUCTION_COUNT) continue;
+    verify_visit(vm, base, addr + i.size, 0, 0);
+  }
+
+  vm->verify_node_count = base;
+}
+
+static const struct word_bounds *verify_word(struct vm *vm, word entry) {
+  struct word_bounds *const w = &vm->word_bounds[entry];
+  if (w->state != UNVISITED) return w;
+
+  *w = (struct word_bounds) { .state = VERIFYING, .balanced = true };
+  const word base = vm->verify_node_count;
+  verify_visit(vm, base, entry, 0, 0);
+  if (verify_walk(vm, base, w)) {
+    w->state = UNVERIFIABLE;
+    vm->verify_node_count = base;
+    verify_unverified(vm, entry);
+    return w;
+  }
+
+  w->state = VERIFIED_WORD;
+  vm->verification[entry] |= VERIFIED_ENTRY;
+  for (word n = base; n < vm->verify_node_count; ++n) {
+    const word addr = vm->verify_nodes[n].addr;
+    struct instruction i;
+    decode(vm, addr, &i);
+    vm->verification[addr] |= VERIFIED;
+    for (word b = addr; b < addr + i.size && b < vm->memory_size; ++b)
+      vm->verification[b] |= VERIFIED_BYTE;
+  }
+  vm->verify_node_count = base;
+
+  return w;
+}
+
+// Verifies the code reachable from the entry point, where execution
+// starts with empty stacks.
+//
+// Snapshots resume somewhere else, but with the stacks of a run that
+// started at the entry point, so their code is verified the same way.
+// Snapshots of runs that had turned verification off stay unverified.
+//
+// The results are kept with the image and shared by its instances,
+// which each turn verification off on their own.
+static int verify_image(struct vm_image *image) {
+  const size_t entries = image->memory_size + MEMORY_PADDING;
+  image->verification = calloc(entries, sizeof(*image->verification));
+  image->word_bounds = calloc(entries, sizeof(*image->word_bounds));
+  if (image->verification == NULL || image->word_bounds == NULL)
+    return dlt_error("failed to allocate memory tables");
+  if (!image->verified) return 0;
+
+  // The image is verified through an instance that never runs.
+  struct vm *const vm = vm_create(image, NULL);
+  if (vm == NULL) return -1;
+  vm->verify_nodes = calloc(image->memory_size, sizeof(*vm->verify_nodes));
+  if (vm->verify_nodes == NULL) {
+    vm_destroy(vm);
+    return dlt_error("failed to allocate memory tables");
+  }
+
+  const struct word_bounds *const w = verify_word(vm, 0);
+  image->verified = !vm->verify_nodes_exhausted;
+  // There is no return address to return to at the entry point.
+  if (w->state == VERIFIED_WORD && (w->returns || w->inputs > 0 ||
+				    w->growth > image->data_stack.size ||
+				    w->rgrowth > image->return_stack.size))
+    image->verified = false;
+
+  vm_destroy(vm);
+  return 0;
+}
+
+// Returns true if a store into memory turned verification off.
+static bool verified_store(struct vm *vm, word addr, word len) {
+  if (!vm->verification_enabled) return false;
+
+  word end = addr + len;
+  if (addr < 0) addr = 0;
+  if (end > vm->memory_size) end = vm->memory_size;
+  for (word i = addr; i < end; ++i) {
+    if (vm->verification[i] & VERIFIED_BYTE) {
+      vm->verification_enabled = false;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* Images */
+// read_image_header checks the header of a versioned image. Version 0
+// images have no header, so the bytes that were read as one are
+// copied to the start of memory instead. It returns the number of
+// bytes copied to memory or -1 if an error occured.
+static int read_image_header(struct vm_image *image,
+			     const struct image_header *header, size_t len,
+			     byte *memory) {
+  if (len < sizeof(*header) ||
+      memcmp(header->magic, IMAGE_MAGIC, IMAGE_MAGIC_SIZE) != 0) {
+    memcpy(memory, header, len);
+    image->cell_order = CELLS_BIG_ENDIAN;
+    return len;
+  }
+
+  if (header->version != IMAGE_VERSION)
+    return dlt_errorf("unsupported image version %d", header->version);
+  if (header->cell_size != WORD_SIZE)
+    return dlt_errorf("unsupported cell size %d", header->cell_size);
+  if (header->cell_order != CELLS_BIG_ENDIAN &&
+      header->cell_order != CELLS_LITTLE_ENDIAN)
+    return dlt_error("invalid cell byte order");
+
+  image->cell_order = header->cell_order;
+  return 0;
+}
+
+// Copies an image to a temporary file that the instances map their
+// memory from. memory_size is rounded up, so that the padding ends at
+// a page boundary.
+static int load_image(struct vm_image *image, FILE *input_file,
+		      const struct image_header *header, size_t header_len,
+		      const struct vm_sizes *sizes) {
+  const size_t memory_len =
+    round_to_pages(sizes->memory_size + MEMORY_PADDING);
+  image->memory_size = memory_len - MEMORY_PADDING;
+  image->data_stack.size = sizes->data_stack_size;
+  image->return_stack.size = sizes->return_stack_size;
+
+  image->file = tmpfile();
+  if (image->file == NULL || ftruncate(fileno(image->file), memory_len))
+    return dlt_error("failed to create image file");
+  byte *const memory = mmap(NULL, memory_len, PROT_READ | PROT_WRITE,
+			    MAP_SHARED, fileno(image->file), 0);
+  if (memory == MAP_FAILED) return dlt_error("failed to map image file");
+  memset(&memory[image->memory_size], HALT, MEMORY_PADDING);
+
+  int err = 0;
+  word memory_offset = read_image_header(image, header, header_len, memory);
+  if (memory_offset < 0) {
+    err = memory_offset;
+    goto cleanup;
+  }
+
+  memory_offset += fread(&memory[memory_offset], sizeof(byte),
+			 image->memory_size - memory_offset, input_file);
+  if (memory_offset >= image->memory_size)
+    err = dlt_error("exceeded available memory");
+
+ cleanup:
+  munmap(memory, memory_len);
+  return err;
+}
+
+/* Snapshots */
+// 'save' writes the state of the VM to a snapshot file that the
+// runtime can be started with instead of an image. Execution resumes
+// after the save instruction with -1 on the data stack, while the run
+// that saved it continues with 0.
+//
+// Memory starts at a page boundary of the file and is mapped
+// copy-on-write, so starting from a snapshot does not read it up
+// front. The fields of the header are in host byte order, snapshots
+// are meant to be used on the machine that wrote them.
+struct snapshot_header {
+  struct image_header image;
+  word memory_size;
+  word instruction_pointer;
+  word data_stack_size;
+  word data_stack_pointer;
+  word return_stack_size;
+  word return_stack_pointer;
+  word verified;
+  // File offsets of memory and of the stacks.
+  word memory_offset;
+  word stacks_offset;
+};
+
+static int save_snapshot(const struct vm *vm, word name, word len, word ip) {
+  char filename[FILENAME_MAX];
+  if (len >= (word)sizeof(filename)) return dlt_error("file name too long");
+  memcpy(filename, &vm->memory[name], len);
+  filename[len] = '\0';
+
+  const size_t memory_len = vm->memory_size + MEMORY_PADDING;
+  const size_t data_len = vm->data_stack.size + 1;
+  const size_t return_len = vm->return_stack.size + 1;
+  struct snapshot_header header = {
+    .image = {
+      .magic = "",
+      .version = SNAPSHOT_VERSION,
+      .cell_order = vm->image_cell_order,
+      .cell_size = WORD_SIZE,
+      .cell_alignment = 1,
+    },
+    .memory_size = vm->memory_size,
+    .instruction_pointer = ip,
+    .data_stack_size = vm->data_stack.size,
+    .data_stack_pointer = vm->data_stack.pointer,
+    .return_stack_size = vm->return_stack.size,
+    .return_stack_pointer = vm->return_stack.pointer,
+    .verified = vm->verification_enabled,
+    .memory_offset = round_to_pages(sizeof(header)),
+  };
+  memcpy(header.image.magic, IMAGE_MAGIC, IMAGE_MAGIC_SIZE);
+  header.stacks_offset = header.memory_offset + memory_len;
+
+  FILE *output_file = fopen(filename, "wb");
+  if (output_file == NULL) return dlt_error("failed to open snapshot file");
+
+  int err = 0;
+  if (fwrite(&header, sizeof(header), 1, output_file) != 1 ||
+      fseek(output_file, header.memory_offset, SEEK_SET) ||
+      fwrite(vm->memory, sizeof(byte), memory_len, output_file) !=
+      memory_len ||
+      fwrite(vm->data_stack.data, sizeof(word), data_len, output_file) !=
+      data_len ||
+      fwrite(vm->return_stack.data, sizeof(word), return_len, output_file) !=
+      return_len)
+    err = dlt_error("failed to write snapshot");
+
+  if (fclose(output_file) && !err) err = dlt_error("failed to write snapshot");
+  return err;
+}
+
+static int read_stack(FILE *input_file, struct stack *s) {
+  s->data = calloc(s->size + 1, sizeof(word));
+  if (s->data == NULL) return dlt_error("failed to allocate stack");
+
+  if (fread(s->data, sizeof(word), s->size + 1, input_file) !=
+      (size_t)s->size + 1)
+    return dlt_error("truncated snapshot");
+
+  return 0;
+}
+
+// Instances map their memory straight from the snapshot file, which
+// stays open as long as the image is loaded.
+static int load_snapshot(struct vm_image *image, FILE *input_file,
+			 const struct image_header *image_header) {
+  struct snapshot_header header = { .image = *image_header };
+  const size_t rest = sizeof(header) - sizeof(header.image);
+  if (fread((byte*)&header + sizeof(header.image), 1, rest, input_file) !=
+      rest)
+    return dlt_error("truncated snapshot");
+
+  if (header.image.cell_size != WORD_SIZE)
+    return dlt_errorf("unsupported cell size %d", header.image.cell_size);
+  if (header.image.cell_order != CELLS_BIG_ENDIAN &&
+      header.image.cell_order != CELLS_LITTLE_ENDIAN)
+    return dlt_error("invalid cell byte order");
+  if (header.memory_size < 1 || header.memory_size > MAX_MEMORY_SIZE ||
+      header.data_stack_size < 1 || header.data_stack_size > MAX_STACK_SIZE ||
+      header.return_stack_size < 1 ||
+      header.return_stack_size > MAX_STACK_SIZE ||
+      header.data_stack_pointer < 0 ||
+      header.data_stack_pointer > header.data_stack_size ||
+      header.return_stack_pointer < 0 ||
+      header.return_stack_pointer > header.return_stack_size ||
+      header.instruction_pointer < 0 ||
+      header.instruction_pointer >= header.memory_size)
+    return dlt_error("invalid snapshot");
+
+  // The snapshot replaces the sizes given on the command line.
+  const size_t memory_len = header.memory_size + MEMORY_PADDING;
+  if (round_to_pages(memory_len) != memory_len)
+    return dlt_error("snapshot was saved with a different page size");
+
+  const size_t data_len = header.data_stack_size + 1;
+  const size_t return_len = header.return_stack_size + 1;
+  struct stat file_stat;
+  if (fstat(fileno(input_file), &file_stat) ||
+      (size_t)file_stat.st_size < header.stacks_offset +
+      (data_len + return_len) * sizeof(word) ||
+      header.stacks_offset < header.memory_offset + (word)memory_len)
+    return dlt_error("truncated snapshot");
+
+  image->file = input_file;
+  image->memory_offset = header.memory_offset;
+  image->memory_size = header.memory_size;
+  image->cell_order = header.image.cell_order;
+  image->instruction_pointer = header.instruction_pointer;
+  image->data_stack = (struct stack) {
+    .pointer = header.data_stack_pointer,
+    .size = header.data_stack_size,
+  };
+  image->return_stack = (struct stack) {
+    .pointer = header.return_stack_pointer,
+    .size = header.return_stack_size,
+  };
+  image->verified = header.verified;
+
+  if (fseek(input_file, header.stacks_offset, SEEK_SET))
+    return dlt_error("truncated snapshot");
+  if (read_stack(input_file, &image->data_stack) ||
+      read_stack(input_file, &image->return_stack))
+    return -1;
+
+  return 0;
+}
+
+/* JIT */
+// On x86-64 the runtime can translate hot words into machine code
+// (enabled with -j). Calls to a word are counted and once a word
+// reached JIT_THRESHOLD calls, its instructions are followed through
+// all branches and stitched together from the per-instruction
+// templates below. Calls to compiled words become native calls. Words
+// that use I/O, call words that cannot be compiled or whose stack
+// depth is not the same on every path to an instruction are left to
+// the interpreter.
+//
+// Compiled code caches the top of the data stack in eax and keeps
+// pointers to the memory of the top cells in rbx (data stack) and r13
+// (return stack) and to memory[] in r12. Its stack effect is computed
+// at compile time, so the interpreter only checks once per call that
+// the stacks have enough cells and room for it. Arithmetic wraps on
+// overflow instead of trapping like a -ftrapv build does.
+//
+// Stores to the bytes of a compiled word throw away all compiled code
+// and those words are interpreted until they get hot again.
+#if defined(__x86_64__) && defined(__unix__) && !defined(NO_JIT)
+#define JIT
+#endif
+
+#ifdef JIT
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 100
+#endif
+#define JIT_MAX_ATTEMPTS 4
+#define JIT_CODE_SIZE (1024 * 1024)
+#define JIT_MAX_INSTRUCTIONS 256
+#define JIT_MAX_INSTRUCTION_CODE 48
+// Recursive words are only compiled if the return stack bounds their
+// depth to this many cells, since every level also takes 32 bytes of
+// the machine stack.
+#define JIT_MAX_RECURSION 65536
+
+typedef word *(*jit_function)(word *data_top, byte *memory, word *return_top);
+
+enum jit_state { JIT_COUNTING, JIT_COMPILED, JIT_FAILED };
+
+struct jit_word {
+  enum jit_state state;
+  unsigned int calls;
+  unsigned int attempts;
+  jit_function code;
+  // Cells the word consumes and the maximum number of cells it adds
+  // to the data and return stack.
+  word inputs;
+  word growth;
+  word rgrowth;
+  // Change of the data stack depth, if it is the same on every path.
+  bool balanced;
+  word delta;
+};
+
+static void jit_invalidate(struct vm *vm, word addr, word len);
+
+static void jit_stored(struct vm *vm, word address, word len) {
+  dictionary_store(vm, address, len);
+  if (verified_store(vm, address, len)) {
+    vm->jit_stored_start = 0;
+    vm->jit_stored_end = vm->memory_size;
+  }
+  if (address < vm->jit_stored_start) vm->jit_stored_start = address;
+  if (address + len > vm->jit_stored_end) vm->jit_stored_end = address + len;
+  jit_invalidate(vm, address, len);
+}
+
+// Helpers of the store templates, which do not pass the instance.
+static void jit_store(word address, word value) {
+  store_word(running_vm, address, value);
+  jit_stored(running_vm, address, WORD_SIZE);
+}
+
+static void jit_bstore(word address, word value) {
+  store_byte(running_vm, address, value & 0xFF);
+  jit_stored(running_vm, address, 1);
+}
+
+// What follows the code of a template.
+enum jit_slot {
+  SLOT_NONE,
+  // The instruction's operand as a 32 bit immediate.
+  SLOT_OPERAND,
+  // A 32 bit displacement to the code of the branch target.
+  SLOT_BRANCH,
+  // The 64 bit address of the template's helper.
+  SLOT_HELPER,
+  // A 32 bit displacement to the code of the called word.
+  SLOT_CALL,
+};
+
+struct jit_template {
+  const char *code;
+  byte size;
+  enum jit_slot slot;
+  const char *tail;
+  byte tail_size;
+  void (*helper)(word address, word value);
+};
+
+#define TEMPLATE(code) { code, sizeof(code) - 1, SLOT_NONE, "", 0, NULL }
+#define TEMPLATE_SLOT(code, slot, tail)				\
+  { code, sizeof(code) - 1, slot, tail, sizeof(tail) - 1, NULL }
+
+// push rbx; push r12; push r13; mov rbx, rdi; mov r12, rsi;
+// mov r13, rdx; mov eax, [rbx]
+#define PROLOGUE "\x53\x41\x54\x41\x55\x48\x89\xfb\x49\x89\xf4\x49\x89\xd5\x8b\x03"
+// mov [rbx], eax; mov rax, rbx; pop r13; pop r12; pop rbx; ret
+#define EPILOGUE "\x89\x03\x48\x89\xd8\x41\x5d\x41\x5c\x5b\xc3"
+// mov [rbx], eax; add rbx, 4
+#define PUSH_TOS "\x89\x03\x48\x83\xc3\x04"
+// sub rbx, 4
+#define POP_SECOND "\x48\x83\xeb\x04"
+// mov eax, [rbx]
+#define LOAD_TOS "\x8b\x03"
+// movzx eax, al; neg eax
+#define FLAG "\x0f\xb6\xc0\xf7\xd8"
+
+static const struct jit_template jit_templates[INSTRUCTION_COUNT] = {
+  [NOP] = TEMPLATE(""),
+  [RETURN] = TEMPLATE(EPILOGUE),
+  // mov eax, imm32
+  [CONST] = TEMPLATE_SLOT(PUSH_TOS "\xb8", SLOT_OPERAND, ""),
+  // movsxd rax, eax; mov eax, [r12 + rax]
+  [FETCH] = TEMPLATE("\x48\x63\xc0\x41\x8b\x04\x04"),
+  // mov edi, eax; mov esi, [rbx - 4]; sub rbx, 8; mov rax, imm64;
+  // call rax; mov eax, [rbx]
+  [STORE] = { "\x89\xc7\x8b\x73\xfc\x48\x83\xeb\x08\x48\xb8", 11,
+	      SLOT_HELPER, "\xff\xd0\x8b\x03", 4, jit_store },
+  // add eax, [rbx]
+  [ADD] = TEMPLATE(POP_SECOND "\x03\x03"),
+  // mov ecx, eax; sub eax, ecx
+  [SUBTRACT] = TEMPLATE(POP_SECOND "\x89\xc1" LOAD_TOS "\x29\xc8"),
+  // imul eax, [rbx]
+  [MULTIPLY] = TEMPLATE(POP_SECOND "\x0f\xaf\x03"),
+  // mov ecx, eax; cdq; idiv ecx
+  [DIVIDE] = TEMPLATE(POP_SECOND "\x89\xc1" LOAD_TOS "\x99\xf7\xf9"),
+  // ... mov eax, edx
+  [MOD] = TEMPLATE(POP_SECOND "\x89\xc1" LOAD_TOS "\x99\xf7\xf9\x89\xd0"),
+  [DUP] = TEMPLATE(PUSH_TOS),
+  [DROP] = TEMPLATE(POP_SECOND LOAD_TOS),
+  // mov ecx, [rbx - 4]; mov [rbx - 4], eax; mov eax, ecx
+  [SWAP] = TEMPLATE("\x8b\x4b\xfc\x89\x43\xfc\x89\xc8"),
+  // mov ecx, [rbx - 4]; ... mov eax, ecx
+  [OVER] = TEMPLATE("\x8b\x4b\xfc" PUSH_TOS "\x89\xc8"),
+  // mov ecx, eax; ... cmp ecx, -1; je rel32
+  // mov [rbx], eax; mov rdi, rbx; mov rsi, r12; mov rdx, r13; call rel32;
+  // mov rbx, rax; mov eax, [rbx]
+  [CALL] = TEMPLATE_SLOT("\x89\x03\x48\x89\xdf\x4c\x89\xe6\x4c\x89\xea\xe8",
+			 SLOT_CALL, "\x48\x89\xc3\x8b\x03"),
+  [CJUMP] = TEMPLATE_SLOT("\x89\xc1" POP_SECOND LOAD_TOS "\x83\xf9\xff\x0f\x84",
+			  SLOT_BRANCH, ""),
+  // cmp [rbx], eax; sete al
+  [EQUALS] = TEMPLATE(POP_SECOND "\x39\x03\x0f\x94\xc0" FLAG),
+  // not eax
+  [NOT] = TEMPLATE("\xf7\xd0"),
+  // and eax, [rbx]
+  [AND] = TEMPLATE(POP_SECOND "\x23\x03"),
+  // or eax, [rbx]
+  [OR] = TEMPLATE(POP_SECOND "\x0b\x03"),
+  // cmp [rbx], eax; setl al
+  [LT] = TEMPLATE(POP_SECOND "\x39\x03\x0f\x9c\xc0" FLAG),
+  // cmp [rbx], eax; setg al
+  [GT] = TEMPLATE(POP_SECOND "\x39\x03\x0f\x9f\xc0" FLAG),
+  // mov eax, [r13]; sub r13, 4
+  [RPOP] = TEMPLATE(PUSH_TOS "\x41\x8b\x45\x00\x49\x83\xed\x04"),
+  // add r13, 4; mov [r13], eax
+  [RPUT] = TEMPLATE("\x49\x83\xc5\x04\x41\x89\x45\x00" POP_SECOND LOAD_TOS),
+  // mov eax, [r13]
+  [RPEEK] = TEMPLATE(PUSH_TOS "\x41\x8b\x45\x00"),
+  // movsxd rax, eax; movzx eax, byte [r12 + rax]
+  [BFETCH] = TEMPLATE("\x48\x63\xc0\x41\x0f\xb6\x04\x04"),
+  [BSTORE] = { "\x89\xc7\x8b\x73\xfc\x48\x83\xeb\x08\x48\xb8", 11,
+	       SLOT_HELPER, "\xff\xd0\x8b\x03", 4, jit_bstore },
+  // jmp rel32
+  [JUMP] = TEMPLATE_SLOT("\xe9", SLOT_BRANCH, ""),
+  // add eax, imm32
+  [CONST_ADD] = TEMPLATE_SLOT("\x05", SLOT_OPERAND, ""),
+  // sub eax, imm32
+  [CONST_SUB] = TEMPLATE_SLOT("\x2d", SLOT_OPERAND, ""),
+  // cmp eax, imm32; sete al
+  [CONST_EQ] = TEMPLATE_SLOT("\x3d", SLOT_OPERAND, "\x0f\x94\xc0" FLAG),
+  // cmp eax, imm32; setl al
+  [CONST_LT] = TEMPLATE_SLOT("\x3d", SLOT_OPERAND, "\x0f\x9c\xc0" FLAG),
+  [CONST_RET] = TEMPLATE_SLOT(PUSH_TOS "\xb8", SLOT_OPERAND, EPILOGUE),
+  [ADD_RET] = TEMPLATE(POP_SECOND "\x03\x03" EPILOGUE),
+  // add eax, [r13]
+  [RPEEK_ADD] = TEMPLATE("\x41\x03\x45\x00"),
+};
+
+// A call of the word that is being compiled. It takes a cell of the
+// return stack like an interpreted call, so the depth of the recursion
+// is bounded by the return stack and its guard page.
+// add r13, 4; mov [r13], eax; ... the call ...; sub r13, 4
+static const struct jit_template jit_self_call =
+  TEMPLATE_SLOT("\x49\x83\xc5\x04\x41\x89\x45\x00"
+		"\x89\x03\x48\x89\xdf\x4c\x89\xe6\x4c\x89\xea\xe8",
+		SLOT_CALL, "\x48\x89\xc3\x8b\x03\x49\x83\xed\x04");
+
+struct jit_node {
+  word addr;
+  int opcode;
+  word operand;
+  // Address of the instruction that follows in memory.
+  word next;
+  // Stack depths relative to the entry of the word.
+  word depth;
+  word rdepth;
+  // Offset of the node's code in the compiled word.
+  size_t offset;
+};
+
+// Adds the instruction at addr to the nodes of a word unless it has
+// already been reached with the same stack depths.
+static int jit_visit(struct jit_node *nodes, word *count,
+		     word addr, word depth, word rdepth) {
+  for (word i = 0; i < *count; ++i) {
+    if (nodes[i].addr != addr) continue;
+    if (nodes[i].depth != depth || nodes[i].rdepth != rdepth) return -1;
+    return 0;
+  }
+
+  if (*count == JIT_MAX_INSTRUCTIONS) return -1;
+  nodes[(*count)++] = (struct jit_node) {
+    .addr = addr, .depth = depth, .rdepth = rdepth
+  };
+
+  return 0;
+}
+
+static int jit_compare_nodes(const void *a, const void *b) {
+  return ((const struct jit_node*)a)->addr - ((const struct jit_node*)b)->addr;
+}
+
+static const struct jit_node *jit_find_node(const struct jit_node *nodes,
+					    word count, word addr) {
+  for (word i = 0; i < count; ++i)
+    if (nodes[i].addr == addr) return &nodes[i];
+
+  return NULL;
+}
+
+// A branch displacement to patch once all nodes were emitted.
+struct jit_fixup {
+  size_t at;
+  word target;
+};
+
+static void jit_emit(byte *code, size_t *len, const void *bytes, size_t size) {
+  memcpy(code + *len, bytes, size);
+  *len += size;
+}
+
+static bool jit_is_self_call(const struct jit_node *node, word entry) {
+  return node->opcode == CALL && node->operand == entry;
+}
+
+// Follows every path through the word at entry and fills in its stack
+// effect. Calls of the word itself get the effect in self or, without
+// one, end their path and set *recursive. Returns like jit_compile().
+static int jit_analyze(struct vm *vm, word entry, struct jit_word *w,
+		       const struct jit_word *self, struct jit_node *nodes,
+		       word *node_count, bool *recursive) {
+  word count = 0;
+  jit_visit(nodes, &count, entry, 0, 0);
+  w->inputs = w->growth = w->rgrowth = 0;
+  w->balanced = true;
+  bool returned = false;
+  for (word n = 0; n < count; ++n) {
+    struct jit_node *const node = &nodes[n];
+    struct instruction i;
+    node->opcode = decode(vm, node->addr, &i);
+    node->operand = i.operand;
+    node->next = node->addr + i.size;
+    if (node->opcode >= INSTRUCTION_COUNT ||
+	jit_templates[node->opcode].code == NULL)
+      return -1;
+
+    struct stack_effect effect = stack_effects[node->opcode];
+    word growth = effect.delta;
+    word rgrowth = effect.rdelta;
+    if (jit_is_self_call(node, entry)) {
+      *recursive = true;
+      if (self == NULL) continue;
+
+      // Every level of the recursion takes a cell of the return stack
+      // (see jit_self_call).
+      effect = (struct stack_effect) { self->inputs, self->delta, 0, 0 };
+      growth = self->growth;
+      rgrowth = 1 + self->rgrowth;
+    } else if (node->opcode == CALL) {
+      // Compiled words call each other natively, so a call has the
+      // stack effect of its callee.
+      if (node->operand >= vm->memory_size) return -1;
+      const struct jit_word *const callee = &vm->jit_words[node->operand];
+      if (callee->state == JIT_FAILED) return -1;
+      if (callee->state != JIT_COMPILED || !callee->balanced) return 1;
+
+      effect = (struct stack_effect) { callee->inputs, callee->delta, 0, 0 };
+      growth = callee->growth;
+      rgrowth = callee->rgrowth;
+    }
+
+    const word depth = node->depth + effect.delta;
+    const word rdepth = node->rdepth + effect.rdelta;
+    const bool returns = node->opcode == RETURN ||
+      node->opcode == CONST_RET || node->opcode == ADD_RET;
+    // The return address of a compiled word is on the machine stack.
+    if (returns ? node->rdepth != 0 : node->rdepth < effect.rinputs)
+      return -1;
+
+    if (effect.inputs - node->depth > w->inputs)
+      w->inputs = effect.inputs - node->depth;
+    if (node->depth + growth > w->growth) w->growth = node->depth + growth;
+    if (node->rdepth + rgrowth > w->rgrowth)
+      w->rgrowth = node->rdepth + rgrowth;
+
+    if (returns) {
+      if (returned && depth != w->delta) w->balanced = false;
+      w->delta = depth;
+      returned = true;
+      continue;
+    }
+    if (node->opcode == JUMP || node->opcode == CJUMP)
+      if (jit_visit(nodes, &count, node->operand, depth, rdepth)) return -1;
+    if (node->opcode != JUMP)
+      if (jit_visit(nodes, &count, node->next, depth, rdepth)) return -1;
+  }
+
+  *node_count = count;
+  // A recursion without a base case.
+  if (*recursive && !returned) return -1;
+  return 0;
+}
+
+// Returns 0 if the word was compiled, 1 if it calls words that have
+// not been compiled yet and -1 if it cannot be compiled.
+//
+// A recursive word is analyzed twice: first without the paths that
+// continue after it calls itself, which gives the effect of its base
+// cases, and then with that effect for its calls of itself. It is
+// only compiled if both agree. The stack bounds are checked on entry
+// for one level of the recursion, deeper levels run into the guard
+// pages.
+static int jit_compile(struct vm *vm, word entry, struct jit_word *w) {
+  static _Thread_local struct jit_node nodes[JIT_MAX_INSTRUCTIONS];
+  static _Thread_local byte code[sizeof(PROLOGUE) + 5 +
+				 JIT_MAX_INSTRUCTIONS *
+				 JIT_MAX_INSTRUCTION_CODE];
+  static _Thread_local struct jit_fixup fixups[2 * JIT_MAX_INSTRUCTIONS + 1];
+
+  if (!vm->native_cells) return -1;
+
+  word count = 0;
+  bool recursive = false;
+  int err = jit_analyze(vm, entry, w, NULL, nodes, &count, &recursive);
+  if (err) return err;
+  if (recursive) {
+    // The recursion also runs on the machine stack.
+    if (!w->balanced || vm->return_stack.size > JIT_MAX_RECURSION) return -1;
+
+    const struct jit_word base = *w;
+    if ((err = jit_analyze(vm, entry, w, &base, nodes, &count, &recursive)))
+      return err;
+    if (!w->balanced || w->delta != base.delta || w->inputs != base.inputs)
+      return -1;
+  }
+
+  // Emit the nodes in the order of their addresses, so most of them
+  // fall through to their successor.
+  qsort(nodes, count, sizeof(struct jit_node), jit_compare_nodes);
+  size_t len = 0;
+  word fixup_count = 0;
+  jit_emit(code, &len, PROLOGUE, sizeof(PROLOGUE) - 1);
+  if (nodes[0].addr != entry) {
+    // The word jumps to code in front of it, e.g. a tail call.
+    jit_emit(code, &len, "\xe9", 1);
+    fixups[fixup_count++] = (struct jit_fixup) { len, entry };
+    len += 4;
+  }
+  for (word n = 0; n < count; ++n) {
+    struct jit_node *const node = &nodes[n];
+    const struct jit_template *const t = jit_is_self_call(node, entry) ?
+      &jit_self_call : &jit_templates[node->opcode];
+    node->offset = len;
+    jit_emit(code, &len, t->code, t->size);
+    switch (t->slot) {
+    case SLOT_NONE:
+      break;
+    case SLOT_OPERAND:
+      jit_emit(code, &len, &node->operand, sizeof(word));
+      break;
+    case SLOT_BRANCH:
+      fixups[fixup_count++] = (struct jit_fixup) { len, node->operand };
+      len += 4;
+      break;
+    case SLOT_HELPER:
+      jit_emit(code, &len, &t->helper, sizeof(t->helper));
+      break;
+    case SLOT_CALL:
+      // Patched once the address of the code is known.
+      len += 4;
+      break;
+    }
+    jit_emit(code, &len, t->tail, t->tail_size);
+
+    const bool falls_through = node->opcode != JUMP && node->opcode != RETURN &&
+      node->opcode != CONST_RET && node->opcode != ADD_RET;
+    if (falls_through && (n + 1 == count || nodes[n + 1].addr != node->next)) {
+      // jmp rel32
+      jit_emit(code, &len, "\xe9", 1);
+      fixups[fixup_count++] = (struct jit_fixup) { len, node->next };
+      len += 4;
+    }
+  }
+
+  for (word i = 0; i < fixup_count; ++i) {
+    const struct jit_node *const target =
+      jit_find_node(nodes, count, fixups[i].target);
+    const word displacement = target->offset - (fixups[i].at + 4);
+    memcpy(code + fixups[i].at, &displacement, 4);
+  }
+
+  if (vm->jit_code_used + len > JIT_CODE_SIZE) return -1;
+  byte *const start = vm->jit_code + vm->jit_code_used;
+  for (word n = 0; n < count; ++n) {
+    if (nodes[n].opcode != CALL) continue;
+    // call rel32, at the end of the template's code
+    const bool self_call = jit_is_self_call(&nodes[n], entry);
+    const size_t at = nodes[n].offset +
+      (self_call ? jit_self_call.size : jit_templates[CALL].size);
+    const byte *const callee = self_call ? start :
+      __extension__ (const byte*)vm->jit_words[nodes[n].operand].code;
+    const word displacement = callee - (start + at + 4);
+    memcpy(code + at, &displacement, 4);
+  }
+
+  if (mprotect(vm->jit_code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE))
+    return -1;
+  memcpy(start, code, len);
+  vm->jit_code_used += len;
+  if (mprotect(vm->jit_code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC))
+    return -1;
+
+  w->code = __extension__ (jit_function)start;
+  for (word n = 0; n < count; ++n)
+    for (word addr = nodes[n].addr; addr < nodes[n].next; ++addr)
+      if (addr < vm->memory_size) vm->jit_covered[addr] = true;
+
+  return 0;
+}
+
+// Throws away all compiled code. Compiled code that is still running
+// (i.e. the word that stored into itself) finishes as compiled.
+static void jit_flush(struct vm *vm) {
+  for (word i = 0; i < vm->memory_size; ++i)
+    vm->jit_words[i] = (struct jit_word) { .state = JIT_COUNTING };
+  memset(vm->jit_covered, false, vm->memory_size * sizeof(*vm->jit_covered));
+  vm->jit_code_used = 0;
+}
+
+static void jit_invalidate(struct vm *vm, word addr, word len) {
+  if (!vm->jit_enabled) return;
+
+  word end = addr + len;
+  if (addr < 0) addr = 0;
+  if (end > vm->memory_size) end = vm->memory_size;
+  for (word i = addr; i < end; ++i) {
+    if (vm->jit_covered[i]) {
+      jit_flush(vm);
+      return;
+    }
+  }
+}
+
+// Counts a call of the word at target and returns its compiled code
+// if there is any.
+static const struct jit_word *jit_lookup(struct vm *vm, word target) {
+  if ((unsigned int)target >= (unsigned int)vm->memory_size) return NULL;
+
+  struct jit_word *const w = &vm->jit_words[target];
+  if (w->state == JIT_COUNTING && ++w->calls >= JIT_THRESHOLD) {
+    switch (jit_compile(vm, target, w)) {
+    case 0:
+      w->state = JIT_COMPILED;
+      break;
+    case 1:
+      // Try again once the callees had the chance to become hot.
+      w->calls = 0;
+      if (++w->attempts < JIT_MAX_ATTEMPTS) break;
+      // fall through
+    default:
+      w->state = JIT_FAILED;
+    }
+  }
+
+  return w->state == JIT_COMPILED ? w : NULL;
+}
+
+#endif
+
+int vm_enable_jit(struct vm *vm) {
+#ifdef JIT
+  if (vm->jit_enabled) return 0;
+
+  vm->jit_code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (vm->jit_code == MAP_FAILED) {
+    vm->jit_code = NULL;
+    return dlt_error("failed to map JIT code memory");
+  }
+
+  vm->jit_words = calloc(vm->memory_size, sizeof(*vm->jit_words));
+  vm->jit_covered = calloc(vm->memory_size, sizeof(*vm->jit_covered));
+  if (vm->jit_words == NULL || vm->jit_covered == NULL)
+    return dlt_error("failed to allocate JIT tables");
+  vm->jit_stored_start = vm->memory_size;
+  vm->jit_enabled = true;
+
+  return 0;
+#else
+  (void)vm;
+  return dlt_error("the runtime was built without the JIT");
+#endif
+}
+
+/* Profiler */
+// The profiler samples where a running instance is on a timer that
+// counts the CPU time of the process (ITIMER_PROF). The signal handler
+// only raises a flag. While the profiler is enabled, run() checks it at
+// every control transfer and takes the sample at the first one after
+// the timer went off. The sample is taken in the instruction that made
+// the transfer, so it lands in the code that used up the CPU time, a
+// few straight-line instructions later at most. Compiled words run as
+// a single step and are attributed to their caller.
+//
+// A sample is the address of that instruction and the return addresses
+// on the return stack, i.e. the cells that follow a call or scall. They
+// are kept as raw addresses and only mapped to dictionary words when
+// the profile is written, by walking the headers from the newest one
+// the program passed to 'find'. Programs that never called it are mapped
+// through the headers in front of the words they call instead (see
+// profile_latest()).
+//
+// The timer and its flag belong to the process, so only one instance
+// at a time can be profiled.
+#define PROFILE_INTERVAL_US 1000
+
+struct profile {
+  // Every sample is its number of frames followed by their addresses,
+  // the outermost one first.
+  word *cells;
+  size_t len;
+  size_t capacity;
+  size_t samples;
+};
+
+static volatile sig_atomic_t profile_pending = 0;
+
+static void on_profile_timer(int signal_number) {
+  (void)signal_number;
+  profile_pending = 1;
+}
+
+// Returns the size of the call that addr returns from, or 0 if there is
+// no call in front of addr. The candidates are decoded like the code
+// they would have been run as.
+static word call_size(const struct vm *vm, word addr) {
+  if (addr <= 0 || addr > vm->memory_size) return 0;
+
+  const word sizes[] = { 1 + WORD_SIZE, 1 + operand_size(CALL16), 1 };
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+    const word call = addr - sizes[s];
+    if (call < 0) continue;
+
+    struct instruction i;
+    const int opcode = decode(vm, call, &i);
+    if ((opcode == CALL || opcode == SCALL) && call + i.size == addr)
+      return sizes[s];
+  }
+  return 0;
+}
+
+static void profile_push(struct vm *vm, word cell) {
+  struct profile *const p = vm->profile;
+  if (p->len == p->capacity) {
+    const size_t capacity = p->capacity ? 2 * p->capacity : 4096;
+    word *const cells = realloc(p->cells, capacity * sizeof(*cells));
+    if (cells == NULL) vm_fatal_error(vm, "failed to grow profile");
+    p->cells = cells;
+    p->capacity = capacity;
+  }
+  p->cells[p->len++] = cell;
+}
+
+// Records a sample in the control transfer at from, which the instance
+// stopped behind with its stacks spilled. The time up to the sample
+// was spent in the word of from, so the return stack is taken as it
+// was before the transfer: a call just pushed a return address and a
+// return just popped the one it returned to.
+static void profile_sample(struct vm *vm, word from) {
+  profile_pending = 0;
+  struct profile *const p = vm->profile;
+  const size_t start = p->len;
+  profile_push(vm, 0);
+
+  struct instruction transfer;
+  const int opcode = decode(vm, from, &transfer);
+  word frames = vm->return_stack.pointer;
+  if ((opcode == CALL || opcode == SCALL) && frames > 0) --frames;
+  for (word i = 1; i <= frames; ++i) {
+    const word addr = vm->return_stack.data[i];
+    const word size = call_size(vm, addr);
+    if (size == 0) continue;
+    // The call belongs to the word that contains its opcode.
+    profile_push(vm, addr - size);
+  }
+  if (opcode == RETURN || opcode == CONST_RET || opcode == ADD_RET) {
+    const word size = call_size(vm, vm->instruction_pointer);
+    if (size > 0) profile_push(vm, vm->instruction_pointer - size);
+  }
+  profile_push(vm, from);
+  p->cells[start] = p->len - start - 1;
+  ++p->samples;
+}
+
+int vm_enable_profiler(struct vm *vm) {
+  if (vm->profile != NULL) return 0;
+
+  vm->profile = calloc(1, sizeof(*vm->profile));
+  if (vm->profile == NULL) return dlt_error("failed to allocate profile");
+
+  // Reads and writes continue after a sample was taken.
+  struct sigaction action = { .sa_flags = SA_RESTART };
+  action.sa_handler = on_profile_timer;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, NULL))
+    return dlt_error("failed to install profiler handler");
+
+  const struct itimerval timer = {
+    .it_interval = { .tv_sec = 0, .tv_usec = PROFILE_INTERVAL_US },
+    .it_value = { .tv_sec = 0, .tv_usec = PROFILE_INTERVAL_US },
+  };
+  if (setitimer(ITIMER_PROF, &timer, NULL))
+    return dlt_error("failed to start profiler timer");
+
+  return 0;
+}
+
+static void stop_profiler(struct vm *vm) {
+  if (vm->profile == NULL) return;
+
+  const struct itimerval timer = { .it_value = { 0, 0 } };
+  setitimer(ITIMER_PROF, &timer, NULL);
+  free(vm->profile->cells);
+  free(vm->profile);
+  vm->profile = NULL;
+}
+
+struct profile_word {
+  word header;
+  // The code of the word from its name up to its last instruction, see
+  // profile_word_end().
+  word start;
+  word end;
+  size_t self;
+  size_t total;
+  // Index of the last sample the word was counted in for total.
+  size_t counted;
+};
+
+// Returns the header in front of the word that starts at entry, laid
+// out as by the assembler and linked to an older header, or 0.
+static word header_in_front(const struct vm *vm, word entry) {
+  for (word len = 1; len < IMMEDIATE_FLAG; ++len) {
+    const word h = entry - len - 1 - WORD_SIZE;
+    if (h <= 0) break;
+    if (header_name_len(vm, h) != len || !valid_header(vm, h)) continue;
+
+    const word link = fetch_word(vm, h);
+    if (link == 0 || (link < h && valid_header(vm, link))) return h;
+  }
+  return 0;
+}
+
+// Returns the newest header the profile can be mapped through. Without
+// one passed to 'find', it is the newest one in front of a word that
+// is called from the code reachable from the entry point (see the
+// Verifier) or from a sampled frame. Older headers are linked from it.
+static word profile_latest(const struct vm *vm) {
+  if (vm->dictionary_latest != 0) return vm->dictionary_latest;
+
+  word latest = 0;
+  for (word entry = 0; entry < vm->memory_size; ++entry) {
+    if (vm->word_bounds[entry].state == UNVISITED) continue;
+    const word h = header_in_front(vm, entry);
+    if (h > latest) latest = h;
+  }
+
+  const struct profile *const p = vm->profile;
+  for (size_t c = 0; c < p->len; c += p->cells[c] + 1)
+    for (word f = 0; f < p->cells[c]; ++f) {
+      struct instruction i;
+      const word addr = p->cells[c + 1 + f];
+      if (addr < 0 || addr >= vm->memory_size ||
+	  decode(vm, addr, &i) != CALL)
+	continue;
+      const word h = header_in_front(vm, i.operand);
+      if (h > latest) latest = h;
+    }
+
+  return latest;
+}
+
+static int compare_profile_words(const void *a, const void *b) {
+  const struct profile_word *const x = a;
+  const struct profile_word *const y = b;
+  return (x->header > y->header) - (x->header < y->header);
+}
+
+static int compare_self(const void *a, const void *b) {
+  const struct profile_word *const x = a;
+  const struct profile_word *const y = b;
+  if (x->self != y->self) return x->self < y->self ? 1 : -1;
+  return (x->total < y->total) - (x->total > y->total);
 }
 
-inline static word stack_pop(struct stack* s) {
-  const word index = --s->pointer;
-  if (index < 0) dlt_fatal_error("stack underflow");
-  return s->data[index];
+// Returns the end of the code of the word that starts at start, so
+// that code between words, e.g. the one at the entry point, is not
+// attributed to the word in front of it. The instructions are decoded
+// up to the first one that does not fall through and is not jumped
+// over by a branch of the word, but at most up to limit.
+static word profile_word_end(const struct vm *vm, word start, word limit) {
+  word addr = start;
+  word reach = start;
+  while (addr < limit) {
+    struct instruction i;
+    const int opcode = decode(vm, addr, &i);
+    if (opcode >= INSTRUCTION_COUNT) break;
+
+    if ((opcode == JUMP || opcode == CJUMP) && i.operand > reach &&
+	i.operand < limit)
+      reach = i.operand;
+    addr += i.size;
+
+    switch (opcode) {
+    case EXIT:
+    case RETURN:
+    case CONST_RET:
+    case ADD_RET:
+    case JUMP:
+      if (reach < addr) return addr;
+    }
+  }
+  return addr < limit ? addr : limit;
+}
+
+// Returns the index of the word whose code contains addr or count for
+// addresses outside of any word.
+static size_t profile_word_at(const struct profile_word *words, size_t count,
+			      word addr) {
+  size_t low = 0;
+  size_t high = count;
+  while (low < high) {
+    const size_t middle = low + (high - low) / 2;
+    if (words[middle].header <= addr) low = middle + 1;
+    else high = middle;
+  }
+
+  if (low == 0) return count;
+  const struct profile_word *const w = &words[low - 1];
+  return addr >= w->start && addr < w->end ? low - 1 : count;
 }
 
-inline static word stack_peek(struct stack* s) {
-  const word index = (s->pointer - 1) % STACK_SIZE;
-  return s->data[index];
+// Words outside of any word are written as '[unknown]'. In folded
+// stacks ';' separates the frames, so it is written as '%3b' there.
+static int write_profile_name(const struct vm *vm,
+			      const struct profile_word *w, bool folded,
+			      FILE *out) {
+  if (w->header == 0) return fputs("[unknown]", out) == EOF ? -1 : 0;
+
+  const word len = header_name_len(vm, w->header);
+  for (word i = 0; i < len; ++i) {
+    const byte c = vm->memory[header_name(w->header) + i];
+    if ((folded && c == ';' ? fputs("%3b", out) : fputc(c, out)) == EOF)
+      return -1;
+  }
+  return 0;
 }
 
-/* I/O functions */
-struct input {
-  char buffer[IO_BUFFER_SIZE];
-  size_t len;
-  size_t cursor;
+struct folded_stack {
+  const size_t *frames;
+  word len;
 };
 
-byte next_char(struct input *i) {
-  if (i->cursor >= i->len) {
-    size_t len = fread(i->buffer, sizeof(i->buffer[0]), 1, stdin);
-    if (len == 0) {
-      if (feof(stdin)) return '\0';
-      dlt_fatal_error("failed to read from stdin");
+static int compare_folded(const void *a, const void *b) {
+  const struct folded_stack *const x = a;
+  const struct folded_stack *const y = b;
+  for (word i = 0; i < x->len && i < y->len; ++i)
+    if (x->frames[i] != y->frames[i])
+      return (x->frames[i] > y->frames[i]) - (x->frames[i] < y->frames[i]);
+  return (x->len > y->len) - (x->len < y->len);
+}
+
+int vm_write_profile(const struct vm *vm, FILE *folded, FILE *flat) {
+  const struct profile *const p = vm->profile;
+  if (p == NULL) return dlt_error("the profiler is not enabled");
+
+  const word latest = profile_latest(vm);
+  if (latest == 0 && p->samples > 0)
+    return dlt_error("found no dictionary headers to map the profile to");
+
+  // Collect the headers, which are not necessarily linked in the order
+  // of their addresses. The last entry stands for all addresses outside
+  // of words.
+  size_t count = 0;
+  for (word h = latest; h != 0 && valid_header(vm, h);
+       h = fetch_word(vm, h)) {
+    // A list longer than memory can hold headers has a cycle.
+    if (count == (size_t)vm->memory_size) break;
+    ++count;
+  }
+
+  int err = 0;
+  struct profile_word *const words = calloc(count + 1, sizeof(*words));
+  struct folded_stack *const stacks = calloc(p->samples + 1, sizeof(*stacks));
+  size_t *const frames = calloc(p->len + 1, sizeof(*frames));
+  if (words == NULL || stacks == NULL || frames == NULL) {
+    err = dlt_error("failed to allocate profile tables");
+    goto cleanup;
+  }
+
+  word h = latest;
+  for (size_t i = 0; i < count; ++i, h = fetch_word(vm, h))
+    words[i] = (struct profile_word) {
+      .header = h,
+      .start = header_name(h) + header_name_len(vm, h),
+    };
+  qsort(words, count, sizeof(*words), compare_profile_words);
+  for (size_t i = 0; i <= count; ++i) {
+    if (i < count)
+      words[i].end =
+	profile_word_end(vm, words[i].start,
+			 i + 1 < count ? words[i + 1].header : vm->memory_size);
+    words[i].counted = SIZE_MAX;
+  }
+
+  // Map every frame to its word and count the words.
+  size_t sample = 0;
+  for (size_t c = 0; c < p->len; c += p->cells[c] + 1, ++sample) {
+    const word len = p->cells[c];
+    stacks[sample] = (struct folded_stack) { &frames[c], len };
+    for (word i = 0; i < len; ++i) {
+      const size_t index = profile_word_at(words, count, p->cells[c + 1 + i]);
+      frames[c + i] = index;
+      if (words[index].counted != sample) {
+	words[index].counted = sample;
+	++words[index].total;
+      }
     }
+    ++words[frames[c + len - 1]].self;
+  }
 
-    i->len = len;
-    i->cursor = 0;
+  // Identical stacks are next to each other once they are sorted.
+  qsort(stacks, p->samples, sizeof(*stacks), compare_folded);
+  for (size_t i = 0; folded != NULL && i < p->samples;) {
+    size_t same = i + 1;
+    while (same < p->samples && compare_folded(&stacks[i], &stacks[same]) == 0)
+      ++same;
+
+    for (word f = 0; f < stacks[i].len; ++f) {
+      if (f > 0 && fputc(';', folded) == EOF) err = -1;
+      if (write_profile_name(vm, &words[stacks[i].frames[f]], true, folded))
+	err = -1;
+    }
+    if (fprintf(folded, " %zu\n", same - i) < 0) err = -1;
+    i = same;
   }
 
-  return (byte)i->buffer[i->cursor++];
+  if (flat != NULL) {
+    qsort(words, count + 1, sizeof(*words), compare_self);
+    if (fprintf(flat, "%zu samples every %dus\n%7s %7s  %s\n",
+		p->samples, PROFILE_INTERVAL_US, "self", "total", "word") < 0)
+      err = -1;
+    for (size_t i = 0; i <= count && words[i].total > 0; ++i) {
+      if (fprintf(flat, "%6.2f%% %6.2f%%  ",
+		  100.0 * words[i].self / p->samples,
+		  100.0 * words[i].total / p->samples) < 0 ||
+	  write_profile_name(vm, &words[i], false, flat) ||
+	  fputc('\n', flat) == EOF)
+	err = -1;
+    }
+  }
+  if (err) dlt_error("failed to write profile");
+
+ cleanup:
+  free(words);
+  free(stacks);
+  free(frames);
+  return err;
 }
 
-/* VM State */
+static void invalidate_decoded(struct vm *vm, word addr, word len) {
+  // Every entry starting less than MAX_INSTRUCTION_SIZE bytes before
+  // addr might span the written bytes.
+  word start = addr - (MAX_INSTRUCTION_SIZE - 1);
+  word end = addr + len;
+  if (start < 0) start = 0;
+  if (end > vm->memory_size) end = vm->memory_size;
+
+  for (word i = start; i < end; ++i)
+    vm->instruction_cache[i].handler = UNDECODED;
+}
+
+static void invalidate(struct vm *vm, word addr, word len) {
+  dictionary_store(vm, addr, len);
+  if (verified_store(vm, addr, len))
+    invalidate_decoded(vm, 0, vm->memory_size);
+  else
+    invalidate_decoded(vm, addr, len);
+#ifdef JIT
+  jit_invalidate(vm, addr, len);
+#endif
+}
 
-// Registers
-word instruction_pointer = 0;
+// Checks the stack bounds of the verified word that checked code
+// transfers control to, or turns verification off if target is in
+// the middle of verified code.
+static void check_entry(struct vm *vm, word target, word dp, word rp) {
+  const byte v = vm->verification[target];
+  if (v & VERIFIED_ENTRY) {
+    const struct word_bounds *const w = &vm->word_bounds[target];
+    if (dp < w->inputs) vm_fatal_error(vm, "stack underflow");
+    if (dp + w->growth > vm->data_stack.size ||
+	rp + w->rgrowth > vm->return_stack.size)
+      vm_fatal_error(vm, "stack overflow");
+  } else if ((v & (VERIFIED | REACHED_UNVERIFIED)) == VERIFIED) {
+    vm->verification_enabled = false;
+    invalidate_decoded(vm, 0, vm->memory_size);
+  }
+}
 
-// Stacks
-struct stack* data_stack = &(struct stack) {
-  .pointer = 0,
-    .data = { 0 },
+/* Tracing */
+// Tracing records every executed instruction (its address, opcode and
+// the top of the data stack) in a ring buffer and counts how often each
+// opcode ran and how often one opcode was directly followed by another
+// in memory. The pair counts show which sequences are worth fusing
+// into superinstructions (see decode()).
+//
+// While tracing, the decoder stores the handler of an instruction in
+// the trace and the TRACE handler in the instruction cache. The TRACE
+// handler records the instruction, swaps its real handler back in and
+// runs it. The previous instruction gets TRACE again, so untraced runs
+// pay nothing and traced ones only one extra dispatch per instruction.
+//
+// The trace is written when the program ends and whenever the process
+// gets SIGUSR1. Like the profiler, only one instance at a time can be
+// traced.
+struct trace_record {
+  int32_t ip;
+  int32_t opcode;
+  int32_t tos;
 };
 
-struct stack* return_stack = &(struct stack) {
-  .pointer = 0,
-    .data = { 0 },
+struct trace_entry {
+  handler handler;
+  int opcode;
 };
 
-// Memory
-byte memory[MEMORY_SIZE] = { EXIT };
-struct input input_buffer = (struct input) {
-  .buffer = { '\0' },
-  .len = 0,
-  .cursor = 0,
+struct trace {
+  char prefix[FILENAME_MAX];
+  // One per address, like the instruction cache.
+  struct trace_entry *entries;
+  struct trace_record *records;
+  size_t capacity;
+  unsigned long long recorded;
+  unsigned long long counts[INSTRUCTION_COUNT];
+  unsigned long long pairs[INSTRUCTION_COUNT][INSTRUCTION_COUNT];
+  // The instruction that ran last, where the next one in memory starts
+  // and the opcode that ran there.
+  word last_ip;
+  word last_next;
+  int last_opcode;
 };
 
-// Helper functions
-inline static void push(word value) {
-  stack_push(data_stack, value);
-}
+static volatile sig_atomic_t trace_dump_pending = 0;
 
-inline static word pop(void) {
-  return stack_pop(data_stack);
+static void on_trace_signal(int signal_number) {
+  (void)signal_number;
+  trace_dump_pending = 1;
 }
 
-inline static word peek(void) {
-  return stack_peek(data_stack);
+static void trace_record(struct trace *t, word ip, word size, word tos) {
+  const int opcode = t->entries[ip].opcode;
+  t->records[t->recorded++ % t->capacity] = (struct trace_record) {
+    .ip = ip, .opcode = opcode, .tos = tos
+  };
+
+  if (opcode < INSTRUCTION_COUNT) {
+    ++t->counts[opcode];
+    if (ip == t->last_next && t->last_opcode < INSTRUCTION_COUNT)
+      ++t->pairs[t->last_opcode][opcode];
+  }
+  t->last_next = ip + size;
+  t->last_opcode = opcode;
 }
 
-inline static void rpush(word value) {
-  stack_push(return_stack, value);
+int vm_enable_trace(struct vm *vm, const char *prefix, size_t records) {
+  if (vm->trace != NULL) return 0;
+  if (records == 0) return dlt_error("the trace needs at least one record");
+
+  struct trace *const t = calloc(1, sizeof(*t));
+  if (t == NULL) return dlt_error("failed to allocate trace");
+  vm->trace = t;
+  strlcpy(t->prefix, prefix, sizeof(t->prefix));
+  t->entries = calloc(vm->memory_size + MEMORY_PADDING, sizeof(*t->entries));
+  t->records = calloc(records, sizeof(*t->records));
+  if (t->entries == NULL || t->records == NULL)
+    return dlt_error("failed to allocate trace");
+  t->capacity = records;
+  t->last_ip = -1;
+  t->last_next = -1;
+  t->last_opcode = INSTRUCTION_COUNT;
+
+  struct sigaction action = { .sa_flags = SA_RESTART };
+  action.sa_handler = on_trace_signal;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGUSR1, &action, NULL))
+    return dlt_error("failed to install trace signal handler");
+
+  // Instructions that were decoded already get TRACE the next time.
+  invalidate_decoded(vm, 0, vm->memory_size);
+  return 0;
 }
 
-inline static word rpop(void) {
-  return stack_pop(return_stack);
+static int write_trace_file(const struct trace *t, const char *extension,
+			    int (*write)(const struct trace *t, FILE *out)) {
+  char filename[FILENAME_MAX] = "";
+  strlcpy(filename, t->prefix, sizeof(filename));
+  if (strlcat(filename, extension, sizeof(filename)) >= sizeof(filename))
+    return dlt_error("trace file name is too long");
+
+  FILE *const out = fopen(filename, "wb");
+  if (out == NULL) return dlt_errorf("failed to open trace file '%s'", filename);
+  const int err = write(t, out);
+  if (fclose(out) || err) return dlt_errorf("failed to write '%s'", filename);
+
+  return 0;
 }
 
-inline static word rpeek(void) {
-  return stack_peek(return_stack);
+// The records in host byte order, the oldest one first.
+static int write_trace_records(const struct trace *t, FILE *out) {
+  const size_t count =
+    t->recorded < t->capacity ? t->recorded : t->capacity;
+  const size_t oldest = t->recorded < t->capacity ? 0 : t->recorded % t->capacity;
+  const size_t tail = count - oldest;
+  if (fwrite(&t->records[oldest], sizeof(*t->records), tail, out) < tail ||
+      fwrite(t->records, sizeof(*t->records), oldest, out) < oldest)
+    return -1;
+
+  return 0;
 }
 
-static int init_memory(char *filename) {
-  FILE* input_file = fopen(filename, "r");
-  if (input_file == NULL) {
-    return dlt_error("failed to open input file");
-  }
+// One 'opcode <name> <count>' or 'pair <name> <name> <count>' line for
+// everything that ran at least once.
+static int write_trace_counts(const struct trace *t, FILE *out) {
+  for (int i = 0; i < INSTRUCTION_COUNT; ++i)
+    if (t->counts[i] > 0 &&
+	fprintf(out, "opcode %s %llu\n", instruction_names[i], t->counts[i]) < 0)
+      return -1;
 
-  word memory_offset = 0;
-  int err = 0;
-  while (fread(&memory[memory_offset], 1, sizeof(byte), input_file)) {
-    if (++memory_offset >= MEMORY_SIZE) {
-      err = dlt_error("exceeded available memory");
-      break;
-    }
-  }
+  for (int i = 0; i < INSTRUCTION_COUNT; ++i)
+    for (int j = 0; j < INSTRUCTION_COUNT; ++j)
+      if (t->pairs[i][j] > 0 &&
+	  fprintf(out, "pair %s %s %llu\n", instruction_names[i],
+		  instruction_names[j], t->pairs[i][j]) < 0)
+	return -1;
 
-  fclose(input_file);
-  return err;
+  return 0;
 }
 
-static byte fetch_byte(word addr) {
-  return memory[addr];
+int vm_write_trace(const struct vm *vm) {
+  const struct trace *const t = vm->trace;
+  if (t == NULL) return dlt_error("tracing is not enabled");
+
+  if (write_trace_file(t, ".trace", write_trace_records)) return -1;
+  return write_trace_file(t, ".counts", write_trace_counts);
 }
 
-static void store_byte(word addr, byte b) {
-  memory[addr] = b;
+static void free_trace(struct vm *vm) {
+  if (vm->trace == NULL) return;
+
+  free(vm->trace->entries);
+  free(vm->trace->records);
+  free(vm->trace);
+  vm->trace = NULL;
 }
 
-static word fetch_word(word addr) {
-  word w = 0;
-  for (unsigned int i = 0; i < WORD_SIZE; ++i) {
-    word b = (word)fetch_byte(addr + i);
-    w |= (b << (WORD_SIZE - (i+1)) * 8);
+// Builds with COUNT_INSTRUCTIONS count every instruction that finishes
+// by continuing with another one, which is how the benchmarks report
+// instructions per second. A superinstruction or a call of a compiled
+// word counts as one.
+#ifdef COUNT_INSTRUCTIONS
+#define COUNT_INSTRUCTION() ++vm->instructions
+#else
+#define COUNT_INSTRUCTION()
+#endif
+
+// Advances the instruction pointer by n bytes and executes the next
+// instruction.
+#define NEXT(n) { ip += (n); COUNT_INSTRUCTION(); DISPATCH(); }
+
+// Every control transfer uses up a step of the budget vm_run() was
+// given. Code without any runs off the end of memory, so this bounds
+// how long run() takes. Profiled instances also stop for a pending
+// sample (see Profiler), which is taken in the transfer at from.
+#define COUNT_STEP(from)						\
+  if (--steps == 0 || (profiling && profile_pending)) {			\
+    transfer = (from);							\
+    goto yield;								\
   }
 
-  return w;
-}
+// Continues execution at an arbitrary address. Only control transfers
+// with a computed target can leave memory, so this is the only place
+// where the instruction pointer needs to be checked.
+#define JUMP(target) {							\
+    const word from = ip;						\
+    ip = (target);							\
+    if ((unsigned int)ip >= (unsigned int)memory_size) goto halt;	\
+    COUNT_INSTRUCTION();						\
+    COUNT_STEP(from);							\
+    DISPATCH();								\
+  }
 
-static void store_word(word addr, word w) {
-  byte buf[WORD_SIZE] = { 0 };
-  word_to_bytes(w, buf);
+// Continues execution at a target resolved by the decoder.
+#define BRANCH(target) {						\
+    const word from = ip;						\
+    ip = (target);							\
+    COUNT_INSTRUCTION();						\
+    COUNT_STEP(from);							\
+    DISPATCH();								\
+  }
 
-  for (unsigned int i = 0; i < WORD_SIZE; ++i)
-    store_byte(addr + i, buf[i]);
-}
+// Skips the bytes spanned by the current (possibly fused) instruction.
+#define SKIP() NEXT(cache[ip].size)
 
-static void usage(void) {
-  puts("Usage: dvm [dopc-file]\n");
-  puts("Flags:");
-  puts("  -h - Displays this usage message.");
-}
+// The top of the data stack (tos) and of the return stack (rtos) are
+// kept in locals of run(), together with both stack pointers. The
+// stack structs only hold the cells below them, so most instructions
+// access memory at most once. The cached values are spilled back to
+// the structs whenever run() returns.
+#define DS(i) ds[dp - (i)]
+#define RS(i) rs[rp - (i)]
 
-int main(int argc, char* argv[]) {
-  if (argc != 2) {
-    usage();
-    dlt_fatal_error("invalid arguments");
+#define CHECK_UNDERFLOW(sp, n)						\
+  if ((sp) < (n)) vm_fatal_error(vm, "stack underflow")
+// Pushing onto a full stack hits the guard page above it. The checked
+// instructions store the instruction pointer first, so that the fault
+// handler can report it.
+#define CHECK_OVERFLOW() vm->instruction_pointer = ip
+// Publishes the instruction pointer before an access to memory at an
+// address computed by the program.
+#define FAULT_POINT() vm->instruction_pointer = ip
+// Instructions that hand a range of memory to the C library check all
+// of it up front, because only faults of their own loads and stores
+// are reported.
+#define CHECK_RANGE(address, len)					\
+  if ((len) < 0 || (address) < 0 || (address) > memory_size - (len))	\
+    out_of_bounds(vm, ip)
+
+#define PUSH(value) {							\
+    CHECK_OVERFLOW();							\
+    const word pushed = (value);					\
+    ds[dp++] = tos;							\
+    tos = pushed;							\
+  }
+#define DROP() { CHECK_UNDERFLOW(dp, 1); tos = ds[--dp]; }
+// Replaces the top two cells with the result of 'second op top'.
+#define BINARY(op) {							\
+    CHECK_UNDERFLOW(dp, 2);						\
+    --dp;								\
+    tos = ds[dp] op tos;						\
+  }
+#define COMPARE(op) {							\
+    CHECK_UNDERFLOW(dp, 2);						\
+    --dp;								\
+    tos = ds[dp] op tos ? -1 : 0;					\
+  }
+
+#define RPUSH(value) {							\
+    CHECK_OVERFLOW();							\
+    const word pushed = (value);					\
+    rs[rp++] = rtos;							\
+    rtos = pushed;							\
   }
+#define RDROP() { CHECK_UNDERFLOW(rp, 1); rtos = rs[--rp]; }
+
+#define CHECK_ENTRY(target)						\
+  if (vm->verification_enabled &&					\
+      (unsigned int)(target) < (unsigned int)memory_size &&		\
+      vm->verification[target])						\
+    check_entry(vm, target, dp, rp)
 
-  char *dopc_filename = argv[1];
-  if (init_memory(dopc_filename)) dlt_panic();
+// Handler of an instruction in the same variant (checked or unchecked)
+// as the current one.
+#define HANDLER_VARIANT(name) HANDLER(name)
+
+#define SPILL() {							\
+    vm->instruction_pointer = ip;					\
+    ds[dp] = tos;							\
+    vm->data_stack.pointer = dp;					\
+    rs[rp] = rtos;							\
+    vm->return_stack.pointer = rp;					\
+  }
 
-  while (instruction_pointer < MEMORY_SIZE) {
-    const word instruction = memory[instruction_pointer];
+#ifdef JIT
+// Runs the compiled code of the word at target instead of calling it,
+// if it has been compiled and the stacks can hold its effect.
+#define RUN_COMPILED(target, length) {					\
+    const struct jit_word *const compiled = jit_lookup(vm, target);	\
+    if (compiled != NULL && dp >= compiled->inputs &&			\
+	dp + compiled->growth <= vm->data_stack.size &&			\
+	rp + compiled->rgrowth <= vm->return_stack.size) {		\
+      vm->instruction_pointer = ip;					\
+      ds[dp] = tos;							\
+      dp = compiled->code(&ds[dp], memory, &rs[rp]) - ds;		\
+      tos = ds[dp];							\
+      if (vm->jit_stored_start < vm->jit_stored_end) {			\
+	invalidate_decoded(vm, vm->jit_stored_start,			\
+			   vm->jit_stored_end - vm->jit_stored_start);	\
+	vm->jit_stored_start = memory_size;				\
+	vm->jit_stored_end = 0;						\
+      }									\
+      NEXT(length);							\
+    }									\
+  }
+#endif
 
 #ifdef DEBUG
-    printf("ds -> ");
-    for (int i = data_stack->pointer - 1; i >= 0; --i)
-      printf("%d ", data_stack->data[i]);
+// Returns the name of the decoded instruction at ip, which can be a
+// superinstruction fused by the decoder.
+static const char *decoded_name(const struct vm *vm, word ip) {
+  int opcode = vm->instruction_cache[ip].handler + DECODE;
+  if (opcode == TRACE) opcode = vm->trace->entries[ip].opcode;
+  if (opcode >= UNCHECKED) opcode -= UNCHECKED;
+  if (opcode == JIT_CALL) opcode = CALL;
+  if (opcode == JIT_SCALL) opcode = SCALL;
+  if (opcode < INSTRUCTION_COUNT) return instruction_names[opcode];
+  return opcode == HALT ? "halt" : "unknown";
+}
+#endif
 
-    printf("| rs -> %d | ip = %d | instr = %s\n",
-	   rpeek(), instruction_pointer, instruction_names[instruction]);
+static enum vm_status run(struct vm *vm, unsigned long steps) {
+  word ip = vm->instruction_pointer;
+  word dp = vm->data_stack.pointer;
+  word rp = vm->return_stack.pointer;
+  // Memory, the stacks and the instruction cache do not move while the
+  // instance exists. Keeping their addresses in locals saves
+  // reloading them after stores.
+  byte *const memory = vm->memory;
+  const word memory_size = vm->memory_size;
+  struct instruction *const cache = vm->instruction_cache;
+  word *const ds = vm->data_stack.data;
+  word *const rs = vm->return_stack.data;
+  word tos = ds[dp];
+  word rtos = rs[rp];
+  // The timer of the profiler belongs to the process, so instances
+  // that are not profiled ignore it.
+  const bool profiling = vm->profile != NULL;
+  word transfer = ip;
+
+#ifdef THREADED_DISPATCH
+  handler dispatch_table[DISPATCH_TABLE_SIZE];
+  for (unsigned int i = 0; i < DISPATCH_TABLE_SIZE; ++i)
+    dispatch_table[i] = HANDLER(UNKNOWN);
+
+#define SET_HANDLERS(name)						\
+  dispatch_table[name] = HANDLER(name);					\
+  dispatch_table[name + UNCHECKED] = UNCHECKED_HANDLER(name);
+  INSTRUCTIONS(SET_HANDLERS)
+  dispatch_table[HALT] = HANDLER(HALT);
+#ifdef JIT
+  dispatch_table[JIT_CALL] = HANDLER(JIT_CALL);
+  dispatch_table[JIT_SCALL] = HANDLER(JIT_SCALL);
+  dispatch_table[JIT_CALL + UNCHECKED] = UNCHECKED_HANDLER(JIT_CALL);
+  dispatch_table[JIT_SCALL + UNCHECKED] = UNCHECKED_HANDLER(JIT_SCALL);
+#endif
 #endif
 
-    switch (instruction) {
-    case EXIT: {
-      puts("\nVM exited normally");
-      return 0;
-    }
-    case NOP: {
-      break;
-    }
-    case CONST: {
-      ++instruction_pointer;
-      push(fetch_word(instruction_pointer));
+#ifdef THREADED_DISPATCH
+  DISPATCH();
+#else
+  while (true) {
+#ifdef DEBUG
+    // Instructions are printed once, after they have been decoded.
+    if (cache[ip].handler != UNDECODED) {
+      printf("ds -> ");
+      if (dp > 0) printf("%d ", tos);
+      for (int i = 1; i < dp; ++i)
+	printf("%d ", DS(i));
 
-      instruction_pointer += WORD_SIZE;
-      continue;
-    }
-    case FETCH: {
-      const word address = pop();
-      push(fetch_word(address));
-      break;
-    }
-    case STORE: {
-      const word address = pop();
-      store_word(address, pop());
-      break;
-    }
-    case ADD: {
-      push(pop() + pop());
-      break;
-    }
-    case SUBTRACT: {
-      const word value = pop();
-      push(pop() - value);
-      break;
-    }
-    case MULTIPLY: {
-      push(pop() * pop());
-      break;
-    }
-    case DIVIDE: {
-      const word value = pop();
-      push(pop() / value);
-      break;
-    }
-    case MOD: {
-      const word value = pop();
-      push(pop() % value);
-      break;
-    }
-    case DUP: {
-      push(peek());
-      break;
-    }
-    case DROP: {
-      pop();
-      break;
-    }
-    case SWAP: {
-      const word x = pop();
-      const word y = pop();
-      push(x);
-      push(y);
-      break;
-    }
-    case OVER: {
-      const word x = pop();
-      const word y = pop();
-      push(y);
-      push(x);
-      push(y);
-      break;
+      printf("| rs -> %d | ip = %d | instr = %s\n",
+	     rtos, ip, decoded_name(vm, ip));
     }
-    case CJUMP: {
-      ++instruction_pointer;
-      if ((int)pop() == -1)
-	instruction_pointer = fetch_word(instruction_pointer);
-      else
-	instruction_pointer += WORD_SIZE;
+#endif
 
-      continue;
+    switch (cache[ip].handler + DECODE) {
+#endif
+    INSTRUCTION(DECODE): {
+      struct instruction *const i = &cache[ip];
+      int opcode = decode(vm, ip, i);
+      const int decoded = opcode;
+#ifdef JIT
+      if (vm->jit_enabled && opcode == CALL) opcode = JIT_CALL;
+      if (vm->jit_enabled && opcode == SCALL) opcode = JIT_SCALL;
+#endif
+      if (vm->verification_enabled &&
+	  (vm->verification[ip] & (VERIFIED | REACHED_UNVERIFIED)) == VERIFIED)
+	opcode += UNCHECKED;
+      i->handler = HANDLER_FOR(opcode);
+      if (vm->trace != NULL) {
+	vm->trace->entries[ip] = (struct trace_entry) { i->handler, decoded };
+	i->handler = HANDLER(TRACE);
+      }
+      DISPATCH();
     }
-    case CALL: {
-      ++instruction_pointer;
-      rpush(instruction_pointer + WORD_SIZE);
-      instruction_pointer = fetch_word(instruction_pointer);
-      continue;
+    INSTRUCTION(TRACE): {
+      struct trace *const t = vm->trace;
+      // The previous instruction is traced again unless a store threw
+      // its entry away. Its handler might have changed while it ran
+      // (see JIT_CALL).
+      const word last = t->last_ip;
+      if (last >= 0 && last != ip && cache[last].handler != UNDECODED &&
+	  cache[last].handler != HANDLER(TRACE)) {
+	t->entries[last].handler = cache[last].handler;
+	cache[last].handler = HANDLER(TRACE);
+      }
+      trace_record(t, ip, cache[ip].size, tos);
+      t->last_ip = ip;
+      cache[ip].handler = t->entries[ip].handler;
+      if (trace_dump_pending) {
+	trace_dump_pending = 0;
+	if (vm_write_trace(vm)) vm_fail(vm);
+      }
+      DISPATCH();
     }
-    case SCALL: {
-      ++instruction_pointer;
-      rpush(instruction_pointer);
-      instruction_pointer = pop();
-      continue;
+    INSTRUCTION(HALT):
+    halt: {
+      // Ran off the end of memory.
+      SPILL();
+      return VM_EXITED;
     }
-    case RETURN: {
-      instruction_pointer = rpop();
-      continue;
+    yield: {
+      SPILL();
+      if (profiling && profile_pending) profile_sample(vm, transfer);
+      if (steps == 0) return VM_RUNNING;
+      DISPATCH();
     }
-    case KEY: {
-      char c = next_char(&input_buffer);
-      push(c);
-      break;
+#ifdef THREADED_DISPATCH
+    INSTRUCTION(UNKNOWN): {
+#else
+    default: {
+#endif
+      dlt_errorf("unknown instruction '%d' at memory location %d",
+		 memory[ip], ip);
+      vm_fail(vm);
     }
-    case EMIT: {
-#ifdef DEBUG
-      printf("\n-->'%c'\n\n", (char)pop());
+
+#include "instructions.h"
+
+    // The instructions of verified words run without stack checks.
+#undef INSTRUCTION
+#undef HANDLER_VARIANT
+#undef CHECK_UNDERFLOW
+#undef CHECK_OVERFLOW
+#undef CHECK_ENTRY
+#ifdef THREADED_DISPATCH
+#define INSTRUCTION(name) op_##name##_unchecked
 #else
-      putchar((char)pop());
+#define INSTRUCTION(name) case name + UNCHECKED
 #endif
-      break;
+#define HANDLER_VARIANT(name) UNCHECKED_HANDLER(name)
+#define CHECK_UNDERFLOW(sp, n)
+#define CHECK_OVERFLOW()
+#define CHECK_ENTRY(target)
+
+#include "instructions.h"
+#ifndef THREADED_DISPATCH
     }
-    case EQUALS: {
-      if (pop() == pop()) push(-1);
-      else push(0);
-      break;
+  }
+#endif
+}
+
+/* Embedding API */
+// See vm.h.
+struct vm_image *vm_image_load(const char *filename,
+			       const struct vm_sizes *sizes) {
+  if (handle_faults()) return NULL;
+
+  struct vm_image *const image = calloc(1, sizeof(*image));
+  if (image == NULL) {
+    dlt_error("failed to allocate image");
+    return NULL;
+  }
+  image->verified = true;
+
+  FILE *const input_file = fopen(filename, "r");
+  if (input_file == NULL) {
+    free(image);
+    dlt_error("failed to open input file");
+    return NULL;
+  }
+
+  int err = 0;
+  struct image_header header = { .magic = "" };
+  const size_t header_len = fread(&header, 1, sizeof(header), input_file);
+  if (header_len == sizeof(header) &&
+      memcmp(header.magic, IMAGE_MAGIC, IMAGE_MAGIC_SIZE) == 0 &&
+      header.version == SNAPSHOT_VERSION) {
+    err = load_snapshot(image, input_file, &header);
+    if (image->file != input_file) fclose(input_file);
+  } else {
+    err = load_image(image, input_file, &header, header_len, sizes);
+    fclose(input_file);
+  }
+
+  if (err || verify_image(image)) {
+    vm_image_free(image);
+    return NULL;
+  }
+
+  return image;
+}
+
+void vm_image_free(struct vm_image *image) {
+  if (image == NULL) return;
+
+  if (image->file != NULL) fclose(image->file);
+  free(image->data_stack.data);
+  free(image->return_stack.data);
+  free(image->verification);
+  free(image->word_bounds);
+  free(image);
+}
+
+struct vm *vm_create(struct vm_image *image, const struct vm_io *io) {
+  struct vm *const vm = calloc(1, sizeof(*vm));
+  if (vm == NULL) {
+    dlt_error("failed to allocate VM");
+    return NULL;
+  }
+
+  vm->image = image;
+  vm->status = VM_RUNNING;
+  vm->instruction_pointer = image->instruction_pointer;
+  vm->data_stack.pointer = image->data_stack.pointer;
+  vm->data_stack.size = image->data_stack.size;
+  vm->return_stack.pointer = image->return_stack.pointer;
+  vm->return_stack.size = image->return_stack.size;
+  vm->memory_size = image->memory_size;
+  vm->image_cell_order = image->cell_order;
+  vm->native_cells = image->cell_order == host_cell_order();
+  vm->io = io != NULL ? *io : stdio_io;
+  vm->verification_enabled = image->verified;
+  vm->verification = image->verification;
+  vm->word_bounds = image->word_bounds;
+
+  if (map_vm(vm) || map_instruction_cache(vm)) {
+    vm_destroy(vm);
+    return NULL;
+  }
+
+  if (image->data_stack.data != NULL) {
+    memcpy(vm->data_stack.data, image->data_stack.data,
+	   (vm->data_stack.size + 1) * sizeof(word));
+    memcpy(vm->return_stack.data, image->return_stack.data,
+	   (vm->return_stack.size + 1) * sizeof(word));
+  }
+
+  return vm;
+}
+
+enum vm_status vm_run(struct vm *vm, unsigned long steps) {
+  if (vm->status != VM_RUNNING || steps == 0) return vm->status;
+
+  running_vm = vm;
+  if (sigsetjmp(vm->failed, 0) == 0) {
+    vm->status = run(vm, steps);
+  } else {
+    vm->status = VM_FAILED;
+    strlcpy(vm->error, error_msg, sizeof(vm->error));
+  }
+  running_vm = NULL;
+
+  return vm->status;
+}
+
+const char *vm_error(const struct vm *vm) {
+  return vm != NULL ? vm->error : error_msg;
+}
+
+void vm_destroy(struct vm *vm) {
+  if (vm == NULL) return;
+
+  if (vm->io.write != NULL) flush_output(vm);
+  unmap_guarded(&vm->memory_region);
+  unmap_guarded(&vm->data_stack_region);
+  unmap_guarded(&vm->return_stack_region);
+  if (vm->instruction_cache != NULL)
+    munmap(vm->instruction_cache, vm->instruction_cache_size);
+  free(vm->verify_nodes);
+  free(vm->dictionary);
+  free(vm->dictionary_bytes);
+  free(vm->dictionary_pending);
+#ifdef JIT
+  if (vm->jit_code != NULL) munmap(vm->jit_code, JIT_CODE_SIZE);
+  free(vm->jit_words);
+  free(vm->jit_covered);
+#endif
+  stop_profiler(vm);
+  free_trace(vm);
+  free(vm);
+}
+
+#ifndef NO_MAIN
+/* Runner */
+// With -t and -n the runtime runs many instances of a program on a
+// pool of threads, all of them sharing the loaded image. Every
+// instance reads all of stdin from the start and writes to stdout.
+// Output buffers are written as a whole, so the output of instances is
+// only interleaved at buffer boundaries.
+struct runner {
+  struct vm_image *image;
+  bool jit;
+  char *input;
+  size_t input_len;
+  pthread_mutex_t lock;
+  // Guarded by lock.
+  word instances;
+  word started;
+  word failed;
+};
+
+struct runner_instance {
+  struct runner *runner;
+  size_t cursor;
+};
+
+static long read_runner_input(void *context, char *buffer, size_t len) {
+  struct runner_instance *const instance = context;
+  const struct runner *const r = instance->runner;
+  if (len > r->input_len - instance->cursor)
+    len = r->input_len - instance->cursor;
+
+  memcpy(buffer, r->input + instance->cursor, len);
+  instance->cursor += len;
+  return len;
+}
+
+static int write_runner_output(void *context, const char *buffer,
+			       size_t len) {
+  struct runner *const r = ((struct runner_instance*)context)->runner;
+  pthread_mutex_lock(&r->lock);
+  const int err = write_stdout(NULL, buffer, len);
+  pthread_mutex_unlock(&r->lock);
+  return err;
+}
+
+static void runner_failed(struct runner *r, word number, const char *error) {
+  pthread_mutex_lock(&r->lock);
+  fprintf(stderr, "instance %d: %s\n", number, error);
+  ++r->failed;
+  pthread_mutex_unlock(&r->lock);
+}
+
+static void *run_instances(void *context) {
+  struct runner *const r = context;
+  while (true) {
+    pthread_mutex_lock(&r->lock);
+    const word number = r->started < r->instances ? r->started++ : -1;
+    pthread_mutex_unlock(&r->lock);
+    if (number < 0) return NULL;
+
+    struct runner_instance instance = { .runner = r, .cursor = 0 };
+    const struct vm_io io = {
+      .read = read_runner_input,
+      .write = write_runner_output,
+      .context = &instance,
+    };
+    struct vm *const vm = vm_create(r->image, &io);
+    if (vm == NULL || (r->jit && vm_enable_jit(vm))) {
+      runner_failed(r, number, vm_error(NULL));
+    } else if (vm_run(vm, VM_UNLIMITED) == VM_FAILED) {
+      runner_failed(r, number, vm_error(vm));
     }
-    case NOT: {
-      push(~pop());
-      break;
+    vm_destroy(vm);
+  }
+}
+
+static int read_input(struct runner *r) {
+  size_t capacity = 0;
+  while (true) {
+    if (r->input_len == capacity) {
+      capacity = capacity ? 2 * capacity : IO_BUFFER_SIZE;
+      char *const input = realloc(r->input, capacity);
+      if (input == NULL) return dlt_error("failed to allocate input buffer");
+      r->input = input;
     }
-    case AND: {
-      push(pop() & pop());
+
+    const long len = read_stdin(NULL, r->input + r->input_len,
+				capacity - r->input_len);
+    if (len < 0) return -1;
+    if (len == 0) return 0;
+    r->input_len += len;
+  }
+}
+
+static int run_runner(struct vm_image *image, word threads, word instances,
+		      bool jit) {
+  struct runner r = {
+    .image = image,
+    .jit = jit,
+    .input = NULL,
+    .input_len = 0,
+    .instances = instances,
+    .started = 0,
+    .failed = 0,
+  };
+  if (read_input(&r)) return -1;
+  pthread_mutex_init(&r.lock, NULL);
+
+  int err = 0;
+  pthread_t *const workers = calloc(threads, sizeof(*workers));
+  word started = 0;
+  if (workers == NULL) err = dlt_error("failed to allocate threads");
+  for (; !err && started < threads; ++started)
+    if (pthread_create(&workers[started], NULL, run_instances, &r))
+      err = dlt_error("failed to start thread");
+  for (word i = 0; i < started; ++i) pthread_join(workers[i], NULL);
+
+  if (!err && r.failed > 0)
+    err = dlt_errorf("%d of %d instances failed", r.failed, instances);
+
+  pthread_mutex_destroy(&r.lock);
+  free(workers);
+  free(r.input);
+  return err;
+}
+
+static void usage(void) {
+  puts("Usage: dvm [flags] [dopc-file]\n");
+  puts("Flags:");
+  puts("  -h - Displays this usage message.");
+#ifdef JIT
+  puts("  -j - Compiles frequently called words to machine code.");
+#endif
+  printf("  -m <bytes> - Size of memory (default: %d).\n",
+	 DEFAULT_MEMORY_SIZE);
+  printf("  -d <cells> - Size of the data stack (default: %d).\n",
+	 DEFAULT_STACK_SIZE);
+  printf("  -r <cells> - Size of the return stack (default: %d).\n",
+	 DEFAULT_STACK_SIZE);
+  puts("  -p <file> - Profiles the program, writes folded stacks to file "
+       "and a table of\n"
+       "              the hottest words to stderr.");
+  printf("  -T <prefix> - Traces the last %d instructions to <prefix>.trace "
+	 "and counts\n"
+	 "                opcodes and their pairs in <prefix>.counts, also on "
+	 "SIGUSR1.\n", TRACE_RECORDS);
+  puts("  -s - Writes statistics of the run to stderr when it ends.");
+  puts("  -n <instances> - Runs this many instances of the program, each "
+       "with all of stdin\n"
+       "                   as input (default: one per thread).");
+  puts("  -t <threads> - Runs the instances of -n on this many threads "
+       "(default: one\n"
+       "                 per processor).");
+}
+
+#ifdef JIT
+#define OPTIONS "hjm:d:r:p:T:sn:t:"
+#else
+#define OPTIONS "hm:d:r:p:T:sn:t:"
+#endif
+
+static long long now_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+// -s writes one 'name value' line per statistic, for the benchmarks
+// in bench/.
+static void write_statistics(const struct vm *vm, long long wall_ns) {
+  fprintf(stderr, "wall_ns %lld\n", wall_ns);
+#ifdef COUNT_INSTRUCTIONS
+  if (vm != NULL) fprintf(stderr, "instructions %llu\n", vm->instructions);
+#else
+  (void)vm;
+#endif
+}
+
+static int parse_size(const char *arg, word max, word *size) {
+  char *end = NULL;
+  const long value = strtol(arg, &end, 10);
+  if (end == arg || *end != '\0' || value < 1 || value > max)
+    return dlt_errorf("invalid size '%s'", arg);
+
+  *size = value;
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  struct vm_sizes sizes = {
+    .memory_size = DEFAULT_MEMORY_SIZE,
+    .data_stack_size = DEFAULT_STACK_SIZE,
+    .return_stack_size = DEFAULT_STACK_SIZE,
+  };
+  bool jit = false;
+  word instances = 0;
+  word threads = 0;
+  const char *profile_filename = NULL;
+  bool statistics = false;
+  const char *trace_prefix = NULL;
+
+  int ch = 0;
+  while ((ch = getopt(argc, argv, OPTIONS)) != -1) {
+    switch (ch) {
+    case 'h':
+      usage();
+      return EXIT_SUCCESS;
+#ifdef JIT
+    case 'j':
+      jit = true;
       break;
-    }
-    case OR: {
-      push(pop() | pop());
+#endif
+    case 'm':
+      if (parse_size(optarg, MAX_MEMORY_SIZE, &sizes.memory_size))
+	dlt_panic();
       break;
-    }
-    case LT: {
-      if ((int)pop() > (int)pop()) push(-1);
-      else push(0);
+    case 'd':
+      if (parse_size(optarg, MAX_STACK_SIZE, &sizes.data_stack_size))
+	dlt_panic();
       break;
-    }
-    case GT: {
-      if ((int)pop() < (int)pop()) push(-1);
-      else push(0);
+    case 'r':
+      if (parse_size(optarg, MAX_STACK_SIZE, &sizes.return_stack_size))
+	dlt_panic();
       break;
-    }
-    case RPOP: {
-      push(rpop());
+    case 'p':
+      profile_filename = optarg;
       break;
-    }
-    case RPUT: {
-      rpush(pop());
+    case 'T':
+      trace_prefix = optarg;
       break;
-    }
-    case RPEEK: {
-      push(rpeek());
+    case 's':
+      statistics = true;
       break;
-    }
-    case BFETCH: {
-      const word address = pop();
-      push(fetch_byte(address));
+    case 'n':
+      if (parse_size(optarg, INT_MAX, &instances)) dlt_panic();
       break;
-    }
-    case BSTORE: {
-      const word address = pop();
-      store_byte(address, pop() & 0xFF);
+    case 't':
+      if (parse_size(optarg, MAX_THREADS, &threads)) dlt_panic();
       break;
-    }
-//    case NATIVE: {
-//      const pointer_t function = native_functions[index];
-//      function();
-//      break;
-//    }
-    default: {
-      printf("Unknown instruction '%d' at memory location %d - aborting.",
-	     instruction, instruction_pointer);
+    default:
+      usage();
       return EXIT_FAILURE;
     }
+  }
+
+  if (argc - optind != 1) {
+    usage();
+    dlt_fatal_error("invalid arguments");
+  }
+
+  struct vm_image *const image = vm_image_load(argv[optind], &sizes);
+  if (image == NULL) dlt_panic();
+
+  if (instances > 0 || threads > 0) {
+    if (profile_filename != NULL || trace_prefix != NULL)
+      dlt_fatal_error("the profiler and tracing only run a single instance");
+    if (threads == 0) {
+      const long processors = sysconf(_SC_NPROCESSORS_ONLN);
+      threads = processors > 0 && processors < MAX_THREADS ? processors : 1;
     }
+    if (instances == 0) instances = threads;
+    const long long start = now_ns();
+    if (run_runner(image, threads, instances, jit)) dlt_panic();
+    if (statistics) write_statistics(NULL, now_ns() - start);
+    vm_image_free(image);
+    return EXIT_SUCCESS;
+  }
 
-    ++instruction_pointer;
+  FILE *profile_file = NULL;
+  if (profile_filename != NULL) {
+    profile_file = fopen(profile_filename, "w");
+    if (profile_file == NULL) dlt_fatal_error("failed to open profile file");
   }
 
-  return 0;
+  struct vm *const vm = vm_create(image, NULL);
+  if (vm == NULL || (jit && vm_enable_jit(vm)) ||
+      (profile_file != NULL && vm_enable_profiler(vm)) ||
+      (trace_prefix != NULL && vm_enable_trace(vm, trace_prefix, TRACE_RECORDS)))
+    dlt_panic();
+  const long long start = now_ns();
+  const enum vm_status status = vm_run(vm, VM_UNLIMITED);
+  const long long wall_ns = now_ns() - start;
+
+  if (profile_file != NULL) {
+    // The output of the program comes before the table.
+    flush_output(vm);
+    const int err = vm_write_profile(vm, profile_file, stderr);
+    fclose(profile_file);
+    if (err) dlt_panic();
+  }
+  if (trace_prefix != NULL && vm_write_trace(vm)) dlt_panic();
+  if (statistics) {
+    flush_output(vm);
+    write_statistics(vm, wall_ns);
+  }
+  vm_destroy(vm);
+  if (status == VM_FAILED) dlt_panic();
+  vm_image_free(image);
+
+  return EXIT_SUCCESS;
 }
+#endif
@@ -10,7 +10,8 @@
 
 /* Error handling */
 #define ERR_MSG_MAX 256
-static char error_msg[ERR_MSG_MAX] = "";
+// Every thread has its own last error.
+static _Thread_local char error_msg[ERR_MSG_MAX] = "";
 
 int dlt_error(char msg[ERR_MSG_MAX]) {
   strlcpy(error_msg, msg, sizeof(error_msg));
@@ -0,0 +1,117 @@
+#ifndef DIATOM_VM
+#define DIATOM_VM
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Embedding API of the runtime. Build runtime.c with -DNO_MAIN to leave
+// out its main() and link it into another program, see examples/.
+// This header only declares the API, so it can be included by any
+// number of files of the host.
+//
+// An image is loaded once and can be shared by any number of instances
+// of the VM, also across threads. Every instance maps the memory of the
+// image copy-on-write, so it only gets private copies of the pages it
+// stores into (e.g. 'here' and the variables). An instance must not be
+// run by two threads at the same time.
+
+// A cell and a byte of the VM, the same types as in diatom.h.
+typedef int word;
+typedef unsigned char byte;
+
+struct vm;
+struct vm_image;
+
+// Sizes used for images. Snapshots bring their own.
+struct vm_sizes {
+  word memory_size;
+  word data_stack_size;
+  word return_stack_size;
+};
+
+// Where an instance reads its input from and writes its output to.
+// read returns the number of bytes read, 0 at the end of the input or
+// -1 on errors. write returns 0 or -1 on errors.
+struct vm_io {
+  long (*read)(void *context, char *buffer, size_t len);
+  int (*write)(void *context, const char *buffer, size_t len);
+  void *context;
+};
+
+enum vm_status {
+  // The step budget ran out, running the instance again continues it.
+  VM_RUNNING,
+  // The program exited or ran off the end of memory.
+  VM_EXITED,
+  // The program failed, see vm_error().
+  VM_FAILED,
+};
+
+// Step budget that never runs out.
+#define VM_UNLIMITED ULONG_MAX
+
+// What a native function called by the 'native' instruction gets. Its
+// inputs are in cells, deepest first, and it replaces them with its
+// outputs. A function that stores into memory records the range, so
+// that code decoded from it is thrown away.
+struct vm_native_call {
+  word *cells;
+  byte *memory;
+  word memory_size;
+  word stored;
+  word stored_len;
+};
+
+// Returns 0 or fails the instance with dlt_error() and -1.
+typedef int (*vm_native_function)(struct vm_native_call *call);
+
+// Most cells a native function can take or return.
+#define VM_NATIVE_MAX_CELLS 16
+
+// Registers a native function with the stack effect ( inputs --
+// outputs ) after the built-in ones in diatom.h and returns its index,
+// the one to pass to '.native' in the assembler. Functions have to be
+// registered before the images that call them are loaded, so that the
+// verifier knows their stack effect. Returns -1 on errors.
+int vm_register_native(vm_native_function function, byte inputs, byte outputs);
+
+// Loads and verifies an image or a snapshot. Returns NULL on errors.
+struct vm_image *vm_image_load(const char *filename,
+			       const struct vm_sizes *sizes);
+// Frees an image whose instances have all been destroyed.
+void vm_image_free(struct vm_image *image);
+
+// Creates an instance that starts at the entry point of the image, or
+// where a snapshot was saved. With io NULL it uses stdin and stdout.
+// Returns NULL on errors.
+struct vm *vm_create(struct vm_image *image, const struct vm_io *io);
+// Compiles the hot words of an instance to machine code (see JIT in
+// runtime.c). Fails if the runtime was built without the JIT.
+int vm_enable_jit(struct vm *vm);
+// Samples where an instance spends its time until it is destroyed (see
+// Profiler in runtime.c). Only one instance at a time can be profiled.
+int vm_enable_profiler(struct vm *vm);
+// Writes the samples taken so far as folded stacks, one line per
+// distinct call stack for flame graph tools, and as a table with the
+// share of samples per word. Either file can be NULL.
+int vm_write_profile(const struct vm *vm, FILE *folded, FILE *flat);
+// Traces the instructions an instance runs (see Tracing in runtime.c),
+// keeping the last records of them. Only one instance at a time can be
+// traced.
+int vm_enable_trace(struct vm *vm, const char *prefix, size_t records);
+// Writes the trace recorded so far to <prefix>.trace and
+// <prefix>.counts. A running instance also writes it whenever the
+// process gets SIGUSR1.
+int vm_write_trace(const struct vm *vm);
+// Runs an instance until it exits, fails or made steps control
+// transfers (taken branches, calls and returns). Compiled words run to
+// completion and count as a single step.
+enum vm_status vm_run(struct vm *vm, unsigned long steps);
+// Returns why an instance failed or, for NULL, why the last call of
+// vm_image_load(), vm_create() or vm_enable_jit() on this thread did.
+const char *vm_error(const struct vm *vm);
+// Flushes the output of an instance and frees it.
+void vm_destroy(struct vm *vm);
+
+#endif